@@ -0,0 +1,133 @@
+/*
+ * cpu-topology.c
+ *
+ * Which CPUs we may run on, and which NUMA node each one belongs to.
+ *
+ * The node of every CPU comes from /sys/devices/system/node/node<N>/cpulist.
+ * Without it (no NUMA support, or no sysfs), every CPU is on node 0.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "cpu-topology.h"
+#include "sync-lib.h"
+
+#define SYSFS_NODE "/sys/devices/system/node"
+
+/*
+ * Read a list of ranges such as "0-3,8,10-11" from a sysfs file,
+ * and set bit i of 'set' for every i in it. Return -1 if the file
+ * cannot be read.
+ */
+static int read_cpulist(const char *path, cpu_set_t *set)
+{
+	FILE *fp;
+	int lo, hi, c;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return -1;
+
+	CPU_ZERO(set);
+	while (fscanf(fp, "%d", &lo) == 1) {
+		hi = lo;
+		if ((c = fgetc(fp)) == '-') {
+			if (fscanf(fp, "%d", &hi) != 1)
+				break;
+			c = fgetc(fp);
+		}
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+			CPU_SET(lo, set);
+		if (c != ',')
+			break;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+void cpu_topology_init(struct cpu_topology *t)
+{
+	cpu_set_t ours, set;
+	char path[64];
+	int cpu, node, max_node, i, n, k, left;
+
+	if (sched_getaffinity(0, sizeof(ours), &ours) < 0) {
+		perror("sched_getaffinity");
+		exit(1);
+	}
+
+	t->ncpus = CPU_COUNT(&ours);
+	t->node = sync_malloc(CPU_SETSIZE * sizeof(*t->node));
+	t->compact = sync_malloc(t->ncpus * sizeof(*t->compact));
+	t->scatter = sync_malloc(t->ncpus * sizeof(*t->scatter));
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		t->node[cpu] = CPU_ISSET(cpu, &ours) ? 0 : -1;
+
+	/* Nodes may be numbered sparsely, look at every possible one */
+	max_node = 0;
+	if (read_cpulist(SYSFS_NODE "/possible", &set) == 0)
+		for (node = 0; node < CPU_SETSIZE; node++)
+			if (CPU_ISSET(node, &set))
+				max_node = node;
+
+	t->nnodes = 1;
+	for (node = 0; node <= max_node; node++) {
+		snprintf(path, sizeof(path), SYSFS_NODE "/node%d/cpulist", node);
+		if (read_cpulist(path, &set) < 0)
+			continue;
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &set) && CPU_ISSET(cpu, &ours)) {
+				t->node[cpu] = node;
+				if (node >= t->nnodes)
+					t->nnodes = node + 1;
+			}
+	}
+
+	/* Compact: node by node, CPUs in order within each */
+	for (n = 0, node = 0; node < t->nnodes; node++)
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (t->node[cpu] == node)
+				t->compact[n++] = cpu;
+
+	/* Scatter: the k-th CPU of every node, for k = 0, 1, ... */
+	for (n = 0, k = 0; n < t->ncpus; k++)
+		for (node = 0; node < t->nnodes; node++)
+			for (i = 0, left = k; i < t->ncpus; i++)
+				if (t->node[t->compact[i]] == node && left-- == 0) {
+					t->scatter[n++] = t->compact[i];
+					break;
+				}
+}
+
+void cpu_topology_destroy(struct cpu_topology *t)
+{
+	free(t->node);
+	free(t->compact);
+	free(t->scatter);
+}
+
+/* The node of a CPU, 0 if unknown */
+int cpu_topology_node(const struct cpu_topology *t, int cpu)
+{
+	if (cpu < 0 || cpu >= CPU_SETSIZE || t->node[cpu] < 0)
+		return 0;
+	return t->node[cpu];
+}
+
+/*
+ * The CPU to run the i-th of a set of threads on:
+ * PLACE_COMPACT fills a node before moving on to the next,
+ * PLACE_SCATTER spreads threads evenly over the nodes.
+ * With more threads than CPUs, they wrap around.
+ */
+int cpu_topology_place(const struct cpu_topology *t, int i, int how)
+{
+	if (how == PLACE_SCATTER)
+		return t->scatter[i % t->ncpus];
+	return t->compact[i % t->ncpus];
+}
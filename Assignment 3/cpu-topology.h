@@ -0,0 +1,28 @@
+/*
+ * cpu-topology.h
+ *
+ * Which CPUs we may run on, and which NUMA node each one belongs to,
+ * to place threads close to (or away from) each other.
+ *
+ */
+
+#ifndef CPU_TOPOLOGY_H__
+#define CPU_TOPOLOGY_H__
+
+enum { PLACE_COMPACT, PLACE_SCATTER };
+
+struct cpu_topology {
+	int ncpus;      /* CPUs in our affinity mask */
+	int nnodes;     /* Highest node id + 1 */
+	int *node;      /* node[cpu], indexed by CPU id, -1 if not ours */
+	int *compact;   /* Our CPUs, filling one node after the other */
+	int *scatter;   /* Our CPUs, going round the nodes */
+};
+
+/* Function prototypes */
+void cpu_topology_init(struct cpu_topology *t);
+void cpu_topology_destroy(struct cpu_topology *t);
+int cpu_topology_node(const struct cpu_topology *t, int cpu);
+int cpu_topology_place(const struct cpu_topology *t, int i, int how);
+
+#endif /* CPU_TOPOLOGY_H__ */
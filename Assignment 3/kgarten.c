@@ -18,12 +18,19 @@
 
 #include <time.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <semaphore.h>
 
+#include "lat-hist.h"
+#include "sync-lib.h"
+#include "tpool.h"
+
 /*
  * POSIX thread functions do not return error numbers in errno,
  * but in the actual return value of the function call instead.
@@ -32,6 +39,36 @@
 #define perror_pthread(ret, msg) \
 	do { errno = ret; perror(msg); } while (0)
 
+#define CACHE_LINE 64
+
+/*
+ * In quiet mode nothing is printed per event, so the threads are not
+ * all serialized on stderr, and the run ends with a summary instead.
+ */
+int quiet;
+
+#define trace(...) \
+	do { if (!quiet) fprintf(stderr, __VA_ARGS__); } while (0)
+
+/* Upper bounds for the random time spent inside and outside, in usec */
+int hold_us = 1000000;
+int think_us = 100000;
+
+/*
+ * A thread waiting to get in, or out, queued in FIFO order.
+ * Whoever admits it does so on its behalf, and then sets granted.
+ */
+struct kg_waiter {
+	struct kg_waiter *next;
+	int granted;            /* 0 waiting, 2 asleep, 1 admitted */
+};
+
+struct kg_queue {
+	struct kg_waiter *head;
+	struct kg_waiter **tail;
+	int len;
+};
+
 /* A virtual kindergarten */
 struct kgarten_struct {
 
@@ -40,7 +77,18 @@ struct kgarten_struct {
 	 * you may need.
 	 */
 
-    pthread_cond_t enough_teachers;
+	/*
+	 * Admission is lock-free: the number of teachers and children
+	 * live together in 'state', so one CAS can check the ratio and
+	 * let a child in, or a teacher out. Threads that cannot go on
+	 * wait in a queue per role, and are let in strictly in order by
+	 * whoever makes room, so exactly as many wake up as fit.
+	 * vt and vc below are left unused.
+	 */
+	uint64_t state;         /* vt in the high half, vc in the low half */
+	struct futex_mutex qlock;       /* Protects the queues */
+	struct kg_queue children;
+	struct kg_queue teachers;
 
 	/*
 	 * You may NOT modify anything in the structure below this
@@ -53,20 +101,33 @@ struct kgarten_struct {
 	pthread_mutex_t mutex;
 };
 
+#define KG_TEACHER ((uint64_t)1 << 32)
+#define KG_CHILD   ((uint64_t)1)
+#define KG_VT(s)   ((long)((s) >> 32))
+#define KG_VC(s)   ((long)((s) & 0xffffffff))
+
 /*
  * A (distinct) instance of this structure
- * is passed to each thread
+ * is passed to each thread. Each is on cache lines of its own,
+ * since its counters are updated all the time.
  */
 struct thread_info_struct {
-	pthread_t tid; /* POSIX thread id, as returned by the library */
-
 	struct kgarten_struct *kg;
 	int is_child;  /* Nonzero if this thread simulates children, zero otherwise */
 
 	int thrid;     /* Application-defined thread id */
 	int thrcnt;
 	unsigned int rseed;
-};
+
+	/* Admission statistics */
+	long entries;       /* Times in, or out for teachers, in total */
+	long waits;         /* Of which, had to queue */
+	long spurious;      /* Wakeups without being admitted */
+	double wait_s;      /* Time spent queued */
+	double max_wait_s;
+	long checks;        /* Invariant checks done */
+	long lat[LAT_BUCKETS];  /* Admission latency histogram, in ns */
+} __attribute__((aligned(CACHE_LINE)));
 
 int safe_atoi(char *s, int *val)
 {
@@ -96,15 +157,30 @@ void *safe_malloc(size_t size)
 
 void usage(char *argv0)
 {
-	fprintf(stderr, "Usage: %s thread_count child_threads c_t_ratio\n\n"
-		"Exactly two argument required:\n"
+	fprintf(stderr, "Usage: %s [-q] [-d seconds] [-H usec] [-T usec] "
+		"thread_count child_threads c_t_ratio\n\n"
+		"Exactly three arguments required:\n"
 		"    thread_count: Total number of threads to create.\n"
 		"    child_threads: The number of threads simulating children.\n"
-		"    c_t_ratio: The allowed ratio of children to teachers.\n\n",
+		"    c_t_ratio: The allowed ratio of children to teachers.\n\n"
+		"Options:\n"
+		"    -q: Quiet: print nothing per event, only a summary at the end.\n"
+		"    -d seconds: Stop after this long (default: run until\n"
+		"       interrupted, or 5 seconds with -q).\n"
+		"    -H usec: Stay inside for up to this long (default: 1000000).\n"
+		"    -T usec: Stay outside for up to this long (default: 100000).\n"
+		"       0 means not sleeping at all.\n\n",
 		argv0);
 	exit(1);
 }
 
+/* Sleep for a random time, up to max_us */
+void random_sleep(struct thread_info_struct *thr, int max_us)
+{
+	if (max_us > 0)
+		usleep(rand_r(&thr->rseed) % max_us);
+}
+
 void bad_thing(int thrid, int children, int teachers)
 {
 	int thing, sex;
@@ -148,31 +224,151 @@ void bad_thing(int thrid, int children, int teachers)
     printf("%s", buf);
 }
 
+/*
+ * Whether a child may come in, or a teacher leave, in state s.
+ * Children only count on the teachers not queued to leave,
+ * or a steady stream of them could keep a teacher in forever.
+ */
+int child_may_enter(struct kgarten_struct *kg, uint64_t s)
+{
+	long tq = __atomic_load_n(&kg->teachers.len, __ATOMIC_SEQ_CST);
+
+	return KG_VC(s) < (KG_VT(s) - tq) * kg->ratio;
+}
+
+int teacher_may_exit(struct kgarten_struct *kg, uint64_t s)
+{
+	return KG_VC(s) <= (KG_VT(s) - 1) * kg->ratio;
+}
+
+double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Apply delta to the state, if may() allows it.
+ * Return nonzero on success.
+ */
+int kg_try(struct kgarten_struct *kg, int64_t delta,
+	int (*may)(struct kgarten_struct *, uint64_t))
+{
+	uint64_t s = __atomic_load_n(&kg->state, __ATOMIC_SEQ_CST);
+
+	do {
+		if (!may(kg, s))
+			return 0;
+	} while (!__atomic_compare_exchange_n(&kg->state, &s, s + delta, 0,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+	return 1;
+}
+
+struct kg_waiter *kg_pop(struct kg_queue *q)
+{
+	struct kg_waiter *w = q->head;
+
+	if ((q->head = w->next) == NULL)
+		q->tail = &q->head;
+	__atomic_store_n(&q->len, q->len - 1, __ATOMIC_SEQ_CST);
+
+	return w;
+}
+
+void kg_grant_one(struct kg_waiter *w)
+{
+	if (__atomic_exchange_n(&w->granted, 1, __ATOMIC_RELEASE) == 2)
+		futex_wake(&w->granted, 1);
+}
+
+/*
+ * Admit queued threads, in order, for as long as there is room:
+ * teachers first, then children. Called with qlock held.
+ */
+void kg_grant(struct kgarten_struct *kg)
+{
+	while (kg->teachers.head && kg_try(kg, -KG_TEACHER, teacher_may_exit))
+		kg_grant_one(kg_pop(&kg->teachers));
+	while (kg->children.head && kg_try(kg, KG_CHILD, child_may_enter))
+		kg_grant_one(kg_pop(&kg->children));
+}
+
+/*
+ * The state has just changed, so that someone queued may go on.
+ * Queueing counts in len before looking at the state, so if nobody
+ * is counted, whoever comes next will see our change.
+ */
+void kg_kick(struct kgarten_struct *kg)
+{
+	if (__atomic_load_n(&kg->teachers.len, __ATOMIC_SEQ_CST) == 0 &&
+	    __atomic_load_n(&kg->children.len, __ATOMIC_SEQ_CST) == 0)
+		return;
+
+	futex_mutex_lock(&kg->qlock);
+	kg_grant(kg);
+	futex_mutex_unlock(&kg->qlock);
+}
+
+/*
+ * Queue up on q, and sleep until admitted. Being in the queue,
+ * we may well be admitted by our own call to kg_grant().
+ */
+void kg_wait(struct thread_info_struct *thr, struct kg_queue *q)
+{
+	struct kgarten_struct *kg = thr->kg;
+	struct kg_waiter me = { NULL, 0 };
+	int w = 0;
+	double t0, t;
+
+	t0 = now_s();
+	futex_mutex_lock(&kg->qlock);
+	*q->tail = &me;
+	q->tail = &me.next;
+	__atomic_store_n(&q->len, q->len + 1, __ATOMIC_SEQ_CST);
+	kg_grant(kg);
+	futex_mutex_unlock(&kg->qlock);
+
+	if (__atomic_compare_exchange_n(&me.granted, &w, 2, 0,
+	    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+		for (;;) {
+			futex_wait(&me.granted, 2);
+			if (__atomic_load_n(&me.granted, __ATOMIC_ACQUIRE) == 1)
+				break;
+			thr->spurious++;
+		}
+
+	t = now_s() - t0;
+	thr->waits++;
+	thr->wait_s += t;
+	if (t > thr->max_wait_s)
+		thr->max_wait_s = t;
+}
+
 void child_enter(struct thread_info_struct *thr)
 {
+	struct kgarten_struct *kg = thr->kg;
+
 	if (!thr->is_child) {
 		fprintf(stderr, "Internal error: %s called for a Teacher thread.\n",
 			__func__);
 		exit(1);
 	}
 
-	fprintf(stderr, "THREAD %d: CHILD ENTER\n", thr->thrid);
-
-    /*
-     * While Loop for spurious wakeups
-     * https://stackoverflow.com/questions/8594591/why-does-pthread-cond-wait-have-spurious-wakeups
-     */
+	trace("THREAD %d: CHILD ENTER\n", thr->thrid);
 
-	pthread_mutex_lock(&thr->kg->mutex);
-    while (thr->kg->vc >= thr->kg->vt * thr->kg->ratio) {
-        pthread_cond_wait(&thr->kg->enough_teachers, &thr->kg->mutex);
-    }
-	++(thr->kg->vc);
-	pthread_mutex_unlock(&thr->kg->mutex);
+	/* Do not overtake anyone already queued */
+	if (__atomic_load_n(&kg->children.len, __ATOMIC_SEQ_CST) != 0 ||
+	    !kg_try(kg, KG_CHILD, child_may_enter))
+		kg_wait(thr, &kg->children);
+	thr->entries++;
 }
 
 void child_exit(struct thread_info_struct *thr)
 {
+	struct kgarten_struct *kg = thr->kg;
 
 	if (!thr->is_child) {
 		fprintf(stderr, "Internal error: %s called for a Teacher thread.\n",
@@ -180,46 +376,44 @@ void child_exit(struct thread_info_struct *thr)
 		exit(1);
 	}
 
-	fprintf(stderr, "THREAD %d: CHILD EXIT\n", thr->thrid);
+	trace("THREAD %d: CHILD EXIT\n", thr->thrid);
 
-	pthread_mutex_lock(&thr->kg->mutex);
-	--(thr->kg->vc);
-    pthread_cond_broadcast(&thr->kg->enough_teachers);
-	pthread_mutex_unlock(&thr->kg->mutex);
+	__atomic_sub_fetch(&kg->state, KG_CHILD, __ATOMIC_SEQ_CST);
+	kg_kick(kg);
 }
 
 void teacher_enter(struct thread_info_struct *thr)
 {
+	struct kgarten_struct *kg = thr->kg;
+
 	if (thr->is_child) {
 		fprintf(stderr, "Internal error: %s called for a Child thread.\n",
 			__func__);
 		exit(1);
 	}
 
-	fprintf(stderr, "THREAD %d: TEACHER ENTER\n", thr->thrid);
+	trace("THREAD %d: TEACHER ENTER\n", thr->thrid);
 
-	pthread_mutex_lock(&thr->kg->mutex);
-	++(thr->kg->vt);
-    pthread_cond_broadcast(&thr->kg->enough_teachers);
-	pthread_mutex_unlock(&thr->kg->mutex);
+	__atomic_add_fetch(&kg->state, KG_TEACHER, __ATOMIC_SEQ_CST);
+	kg_kick(kg);
+	thr->entries++;
 }
 
 void teacher_exit(struct thread_info_struct *thr)
 {
+	struct kgarten_struct *kg = thr->kg;
+
 	if (thr->is_child) {
 		fprintf(stderr, "Internal error: %s called for a Child thread.\n",
 			__func__);
 		exit(1);
 	}
 
-	fprintf(stderr, "THREAD %d: TEACHER EXIT\n", thr->thrid);
+	trace("THREAD %d: TEACHER EXIT\n", thr->thrid);
 
-	pthread_mutex_lock(&thr->kg->mutex);
-    while (thr->kg->vc > (thr->kg->vt - 1) * thr->kg->ratio) {
-        pthread_cond_wait(&thr->kg->enough_teachers, &thr->kg->mutex);
-    }
-	--(thr->kg->vt);
-	pthread_mutex_unlock(&thr->kg->mutex);
+	if (__atomic_load_n(&kg->teachers.len, __ATOMIC_SEQ_CST) != 0 ||
+	    !kg_try(kg, -KG_TEACHER, teacher_may_exit))
+		kg_wait(thr, &kg->teachers);
 }
 
 /*
@@ -228,13 +422,15 @@ void teacher_exit(struct thread_info_struct *thr)
 void verify(struct thread_info_struct *thr)
 {
         struct kgarten_struct *kg = thr->kg;
+        uint64_t s = __atomic_load_n(&kg->state, __ATOMIC_SEQ_CST);
         int t, c, r;
 
-        c = kg->vc;
-        t = kg->vt;
+        c = KG_VC(s);
+        t = KG_VT(s);
         r = kg->ratio;
 
-        fprintf(stderr, "            Thread %d: Teachers: %d, Children: %d\n",
+        thr->checks++;
+        trace("            Thread %d: Teachers: %d, Children: %d\n",
                 thr->thrid, t, c);
 
         if (c > t * r) {
@@ -253,66 +449,154 @@ void *thread_start_fn(void *arg)
 	/* We know arg points to an instance of thread_info_struct */
 	struct thread_info_struct *thr = arg;
 	char *nstr;
+	double t0;
 
-	fprintf(stderr, "Thread %d of %d. START.\n", thr->thrid, thr->thrcnt);
+	trace("Thread %d of %d. START.\n", thr->thrid, thr->thrcnt);
 
 	nstr = thr->is_child ? "Child" : "Teacher";
 	for (;;) {
-		fprintf(stderr, "Thread %d [%s]: Entering.\n", thr->thrid, nstr);
-		if (thr->is_child)
+		trace("Thread %d [%s]: Entering.\n", thr->thrid, nstr);
+		if (thr->is_child) {
+			t0 = now_s();
 			child_enter(thr);
-		else
+			thr->lat[lat_bucket((now_s() - t0) * 1e9)]++;
+		} else
 			teacher_enter(thr);
 
-		fprintf(stderr, "Thread %d [%s]: Entered.\n", thr->thrid, nstr);
+		trace("Thread %d [%s]: Entered.\n", thr->thrid, nstr);
 
 		/*
 		 * We're inside the critical section,
 		 * just sleep for a while.
 		 */
 		/* usleep(rand_r(&thr->rseed) % 1000000 / (thr->is_child ? 10000 : 1)); */
-        	pthread_mutex_lock(&thr->kg->mutex);
 		verify(thr);
-        	pthread_mutex_unlock(&thr->kg->mutex);
 
-		usleep(rand_r(&thr->rseed) % 1000000);
+		random_sleep(thr, hold_us);
 
-		fprintf(stderr, "Thread %d [%s]: Exiting.\n", thr->thrid, nstr);
+		trace("Thread %d [%s]: Exiting.\n", thr->thrid, nstr);
 		/* CRITICAL SECTION END */
 
 		if (thr->is_child)
 			child_exit(thr);
-		else
+		else {
+			t0 = now_s();
 			teacher_exit(thr);
+			thr->lat[lat_bucket((now_s() - t0) * 1e9)]++;
+		}
 
-		fprintf(stderr, "Thread %d [%s]: Exited.\n", thr->thrid, nstr);
+		trace("Thread %d [%s]: Exited.\n", thr->thrid, nstr);
 
 		/* Sleep for a while before re-entering */
 		/* usleep(rand_r(&thr->rseed) % 100000 * (thr->is_child ? 100 : 1)); */
-		usleep(rand_r(&thr->rseed) % 100000);
+		random_sleep(thr, think_us);
 
-        	pthread_mutex_lock(&thr->kg->mutex);
 		verify(thr);
-        	pthread_mutex_unlock(&thr->kg->mutex);
 	}
 
-	fprintf(stderr, "Thread %d of %d. END.\n", thr->thrid, thr->thrcnt);
+	trace("Thread %d of %d. END.\n", thr->thrid, thr->thrcnt);
 
 	return NULL;
 }
 
+/*
+ * Admission statistics, per role, over 'elapsed' seconds.
+ * Admission is getting in for children, getting out for teachers.
+ * The counters are only written by their own thread; reading them
+ * while it runs may be slightly off.
+ */
+void report(struct thread_info_struct *thr, int thrcnt, double elapsed)
+{
+	long entries, waits, spurious, admitted, checks, total;
+	double wait_s, max_wait_s;
+	long lat[LAT_BUCKETS];
+	int i, b, role;
+
+	printf("Ran for %.3f s\n", elapsed);
+	checks = total = 0;
+	for (role = 1; role >= 0; role--) {
+		entries = waits = spurious = admitted = 0;
+		wait_s = max_wait_s = 0;
+		memset(lat, 0, sizeof(lat));
+		for (i = 0; i < thrcnt; i++) {
+			if (thr[i].is_child != role)
+				continue;
+			checks += thr[i].checks;
+			entries += thr[i].entries;
+			waits += thr[i].waits;
+			spurious += thr[i].spurious;
+			wait_s += thr[i].wait_s;
+			if (thr[i].max_wait_s > max_wait_s)
+				max_wait_s = thr[i].max_wait_s;
+			for (b = 0; b < LAT_BUCKETS; b++) {
+				lat[b] += thr[i].lat[b];
+				admitted += thr[i].lat[b];
+			}
+		}
+		total += entries;
+		printf("%s: %ld entries, %.0f/s, %ld waited to get %s, "
+			"avg wait %.3f ms, max wait %.3f ms, %ld spurious wakeups\n",
+			role ? "Children" : "Teachers", entries, entries / elapsed,
+			waits, role ? "in" : "out",
+			waits ? wait_s / waits * 1e3 : 0.0, max_wait_s * 1e3,
+			spurious);
+		printf("%s: admission latency p50 %.3f us, p99 %.3f us\n",
+			role ? "Children" : "Teachers",
+			lat_quantile(lat, admitted, 0.50),
+			lat_quantile(lat, admitted, 0.99));
+	}
+	printf("Total: %ld entries, %.0f/s, %ld invariant checks, all held\n",
+		total, total / elapsed, checks);
+}
 
 int main(int argc, char *argv[])
 {
-	int i, ret, thrcnt, chldcnt, ratio;
+	int i, ret, opt, thrcnt, chldcnt, ratio;
 	struct thread_info_struct *thr;
 	struct kgarten_struct *kg;
+	struct tpool pool;
+	double duration = -1, start;
+	struct timespec ts;
+	char *endp;
+	sigset_t sigs;
 
 	/*
 	 * Parse the command line
 	 */
-	if (argc != 4)
+	while ((opt = getopt(argc, argv, "qd:H:T:")) != -1) {
+		switch (opt) {
+		case 'q':
+			quiet = 1;
+			break;
+		case 'd':
+			duration = strtod(optarg, &endp);
+			if (endp == optarg || *endp != '\0' || duration <= 0) {
+				fprintf(stderr, "`%s' is not a valid duration\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'H':
+			if (safe_atoi(optarg, &hold_us) < 0 || hold_us < 0) {
+				fprintf(stderr, "`%s' is not a valid hold time\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'T':
+			if (safe_atoi(optarg, &think_us) < 0 || think_us < 0) {
+				fprintf(stderr, "`%s' is not a valid think time\n", optarg);
+				exit(1);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 3)
 		usage(argv[0]);
+	argv += optind - 1;
+	if (duration < 0 && quiet)
+		duration = 5;
+
 	if (safe_atoi(argv[1], &thrcnt) < 0 || thrcnt <= 0) {
 		fprintf(stderr, "`%s' is not valid for `thread_count'\n", argv[1]);
 		exit(1);
@@ -335,6 +619,12 @@ int main(int argc, char *argv[])
 	kg = safe_malloc(sizeof(*kg));
 	kg->vt = kg->vc = 0;
 	kg->ratio = ratio;
+	kg->state = 0;
+	futex_mutex_init(&kg->qlock);
+	kg->children.head = kg->teachers.head = NULL;
+	kg->children.tail = &kg->children.head;
+	kg->teachers.tail = &kg->teachers.head;
+	kg->children.len = kg->teachers.len = 0;
 
 	ret = pthread_mutex_init(&kg->mutex, NULL);
 	if (ret) {
@@ -342,13 +632,33 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-    ret = pthread_cond_init(&kg->enough_teachers, NULL);
-	/* ... */
+	/*
+	 * The threads run forever. Block SIGINT and SIGTERM in all of them,
+	 * so that this thread can catch them, or run out of time,
+	 * and report before exiting.
+	 */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	ret = pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	if (ret) {
+		perror_pthread(ret, "pthread_sigmask");
+		exit(1);
+	}
 
 	/*
 	 * Create threads
 	 */
-	thr = safe_malloc(thrcnt * sizeof(*thr));
+	ret = posix_memalign((void **)&thr, CACHE_LINE, thrcnt * sizeof(*thr));
+	if (ret) {
+		perror_pthread(ret, "posix_memalign");
+		exit(1);
+	}
+	memset(thr, 0, thrcnt * sizeof(*thr));
+	start = now_s();
+
+	/* Every thread runs forever, so each needs a worker of its own */
+	tpool_init(&pool, thrcnt, thrcnt);
 
 	for (i = 0; i < thrcnt; i++) {
 		/* Initialize per-thread structure */
@@ -358,24 +668,27 @@ int main(int argc, char *argv[])
 		thr[i].is_child = (i < chldcnt);
 		thr[i].rseed = rand();
 
-		/* Spawn new thread */
-		ret = pthread_create(&thr[i].tid, NULL, thread_start_fn, &thr[i]);
-		if (ret) {
-			perror_pthread(ret, "pthread_create");
+		/* Run it on the pool */
+		if (tpool_submit(&pool, thread_start_fn, &thr[i], NULL) < 0) {
+			perror("tpool_submit");
 			exit(1);
 		}
 	}
 
 	/*
-	 * Wait for all threads to terminate
+	 * Wait to be interrupted, or for the time to run out
 	 */
-	for (i = 0; i < thrcnt; i++) {
-		ret = pthread_join(thr[i].tid, NULL);
-		if (ret) {
-			perror_pthread(ret, "pthread_join");
-			exit(1);
-		}
+	if (duration > 0) {
+		ts.tv_sec = duration;
+		ts.tv_nsec = (duration - ts.tv_sec) * 1e9;
+		ret = sigtimedwait(&sigs, NULL, &ts);
+	} else
+		ret = sigwaitinfo(&sigs, NULL);
+	if (ret < 0 && errno != EAGAIN) {
+		perror("sigwait");
+		exit(1);
 	}
+	report(thr, thrcnt, now_s() - start);
 
 	printf("OK.\n");
 
@@ -0,0 +1,43 @@
+/*
+ * lat-hist.c
+ *
+ * Log-linear latency histograms. See lat-hist.h.
+ *
+ */
+
+#include "lat-hist.h"
+
+/* The bucket a value of ns nanoseconds falls into */
+int lat_bucket(uint64_t ns)
+{
+	int e;
+
+	if (ns < (1 << LAT_SUB_BITS))
+		return ns;
+	e = 63 - __builtin_clzll(ns);
+	return ((e - LAT_SUB_BITS + 1) << LAT_SUB_BITS) +
+		((ns >> (e - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+/* The smallest value that falls into bucket b */
+double lat_bucket_ns(int b)
+{
+	int e = (b >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+
+	if (b < (1 << LAT_SUB_BITS))
+		return b;
+	return (double)((1 << LAT_SUB_BITS) + (b & ((1 << LAT_SUB_BITS) - 1)))
+		* (1ULL << (e - LAT_SUB_BITS));
+}
+
+/* The p-th quantile of a histogram of n values, in usec */
+double lat_quantile(long *lat, long n, double p)
+{
+	long seen = 0;
+	int b;
+
+	for (b = 0; b < LAT_BUCKETS; b++)
+		if ((seen += lat[b]) > 0 && seen >= p * n)
+			return lat_bucket_ns(b) / 1e3;
+	return 0;
+}
@@ -0,0 +1,26 @@
+/*
+ * lat-hist.h
+ *
+ * Log-linear latency histograms of nanoseconds:
+ * 2^LAT_SUB_BITS buckets for every power of two, so every bucket
+ * is within 12.5% of the values in it.
+ *
+ * A histogram is just an array of LAT_BUCKETS counts; threads keep
+ * one each, and add them up for reporting.
+ *
+ */
+
+#ifndef LAT_HIST_H__
+#define LAT_HIST_H__
+
+#include <stdint.h>
+
+#define LAT_SUB_BITS 3
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
+
+/* Function prototypes */
+int lat_bucket(uint64_t ns);
+double lat_bucket_ns(int b);
+double lat_quantile(long *lat, long n, double p);
+
+#endif /* LAT_HIST_H__ */
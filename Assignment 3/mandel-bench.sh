@@ -0,0 +1,115 @@
+#!/bin/bash
+#
+# mandel-bench.sh
+#
+# Benchmark mandel over a few fixed views, sweeping thread counts,
+# scheduling policies and kernels. Results go to stdout, as CSV.
+# Speedup and efficiency are relative to a single thread
+# with the same view, kernel and policy.
+#
+# The fork policy runs mandel-fork instead, with processes in place of
+# threads, handing out lines dynamically; it only has the double kernel.
+#
+# Environment variables:
+#   MAXTHREADS  Highest thread count to try (default: number of CPUs).
+#   SIZE        WIDTHxHEIGHT of the frame (default: 320x240).
+#   ITER        Maximum iterations per point (default: 2000).
+#   REPS        Runs per configuration, the fastest one is kept (default: 3).
+#   OUTPUT      1 to include drawing the frame on the terminal,
+#               0 to only compute it (default: 0).
+#   VIEWS, POLICIES, KERNELS
+#               Space-separated subsets of the names below.
+#
+
+MANDEL=${MANDEL:-./mandel}
+MANDEL_FORK=${MANDEL_FORK:-./mandel-fork}
+MAXTHREADS=${MAXTHREADS:-$(nproc)}
+SIZE=${SIZE:-320x240}
+ITER=${ITER:-2000}
+REPS=${REPS:-3}
+OUTPUT=${OUTPUT:-0}
+
+declare -A VIEW_OPTS=(
+	[full]="-C -0.5,0 -z 1"
+	[seahorse]="-C -0.745,0.11 -z 40"
+	[deep]="-C -0.743643887037158704752191506114774,0.131825904205311970493132056385139 -z 1e12"
+)
+declare -A POLICY_OPTS=(
+	[static]="-s static"
+	[dynamic]="-s dynamic"
+	[refine]="-s dynamic -a"
+	[fork]=""
+)
+declare -A KERNEL_OPTS=(
+	[double]="-k double"
+	[float]="-k float"
+	[fixed]="-k fixed"
+	[deep]="-k deep"
+	[auto]="-k auto"
+)
+
+VIEWS=${VIEWS:-"full seahorse deep"}
+POLICIES=${POLICIES:-"static dynamic refine fork"}
+KERNELS=${KERNELS:-"double deep auto"}
+
+for prog in "$MANDEL" "$MANDEL_FORK"; do
+	if [ ! -x "$prog" ]; then
+		echo "$0: $prog not found, run make first" >&2
+		exit 1
+	fi
+done
+
+# Run mandel once, print its elapsed time in seconds
+run_once()
+{
+	if [ "$OUTPUT" = 1 ]; then
+		$MANDEL -v "$@" 2>&1 >/dev/null
+	else
+		$MANDEL -v -q "$@" 2>&1 >/dev/null
+	fi | awk '/^Elapsed:/ { print $2 }'
+}
+
+# Run mandel-fork once, print its elapsed time in seconds
+run_fork()
+{
+	if [ "$OUTPUT" = 1 ]; then
+		$MANDEL_FORK "$@" 2>&1 >/dev/null
+	else
+		$MANDEL_FORK -q "$@" 2>&1 >/dev/null
+	fi | awk '/^Computed/ { for (i = 1; i < NF; i++) if ($i == "in") print $(i + 1) }'
+}
+
+echo "view,kernel,policy,output,threads,wall_s,pixels_per_s,speedup,efficiency"
+
+pixels=$(echo "$SIZE" | awk -Fx '{ print $1 * $2 }')
+
+for view in $VIEWS; do
+	for kernel in $KERNELS; do
+		for policy in $POLICIES; do
+			[ "$policy" = fork ] && [ "$kernel" != double ] && continue
+			base=
+			for ((t = 1; t <= MAXTHREADS; t++)); do
+				best=
+				for ((r = 0; r < REPS; r++)); do
+					if [ "$policy" = fork ]; then
+						s=$(run_fork ${VIEW_OPTS[$view]} -g "$SIZE" -i "$ITER" "$t")
+					else
+						s=$(run_once ${VIEW_OPTS[$view]} ${KERNEL_OPTS[$kernel]} \
+							${POLICY_OPTS[$policy]} -g "$SIZE" -i "$ITER" "$t")
+					fi
+					if [ -z "$s" ]; then
+						echo "$0: mandel failed for $view/$kernel/$policy/$t" >&2
+						exit 1
+					fi
+					best=$(awk -v a="$s" -v b="$best" \
+						'BEGIN { print (b == "" || a < b) ? a : b }')
+				done
+				[ -z "$base" ] && base=$best
+				awk -v v="$view" -v k="$kernel" -v p="$policy" -v o="$OUTPUT" \
+				    -v t="$t" -v s="$best" -v b="$base" -v px="$pixels" \
+				    'BEGIN { printf "%s,%s,%s,%d,%d,%.6f,%.0f,%.3f,%.3f\n",
+					v, k, p, o, t, s, px / s, b / s, b / s / t }'
+			done
+		done
+	done
+done
@@ -0,0 +1,302 @@
+/*
+ * mandel-cache.c
+ *
+ * A cache of Mandelbrot Set tiles, so overlapping or repeated
+ * views only compute the tiles they have not seen before.
+ *
+ * Tiles are kept in memory, in LRU order, up to a fixed number of them.
+ * Optionally, they are also kept in a memory-mapped file, which survives
+ * from one run to the next. The file is a 2-way set-associative table:
+ * every tile has a pair of slots it may go to, and replaces whatever was
+ * in one of them if both are taken.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mandel-cache.h"
+#include "sync-lib.h"
+
+#define TILE_DISK_MAGIC "MANDTIL1"
+
+struct tile_disk_slot {
+	struct tile_key key;
+	uint32_t valid;
+	uint32_t pad;
+	uint16_t iter[TILE_SIZE * TILE_SIZE];
+};
+
+struct tile_disk {
+	char magic[8];
+	uint32_t tile_size;
+	uint32_t pad;
+	uint64_t nslots;
+	struct tile_disk_slot slot[];
+};
+
+static unsigned long tile_hash(const struct tile_key *k)
+{
+	uint64_t h;
+
+	h = (uint64_t)k->tx * 0x9E3779B97F4A7C15ULL;
+	h ^= (uint64_t)k->ty * 0xC2B2AE3D27D4EB4FULL;
+	h ^= ((uint64_t)k->level << 32 | (uint32_t)k->max_iter) * 0x165667B19E3779F9ULL;
+
+	/* Mix the high bits into the low ones, which pick the bucket */
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	return h ^ (h >> 33);
+}
+
+static int tile_key_equal(const struct tile_key *a, const struct tile_key *b)
+{
+	return a->tx == b->tx && a->ty == b->ty &&
+		a->level == b->level && a->max_iter == b->max_iter;
+}
+
+/*
+ * Return the disk slot holding a tile, or, if it is not on disk,
+ * the slot it should go to, with *found set to 0.
+ */
+static struct tile_disk_slot *tile_disk_slot(struct tile_cache *c,
+	const struct tile_key *key, unsigned long h, int *found)
+{
+	struct tile_disk_slot *s = &c->disk->slot[h % (c->disk_slots / 2) * 2];
+
+	*found = 1;
+	if (s[0].valid && tile_key_equal(&s[0].key, key))
+		return &s[0];
+	if (s[1].valid && tile_key_equal(&s[1].key, key))
+		return &s[1];
+
+	*found = 0;
+	if (!s[0].valid)
+		return &s[0];
+	if (!s[1].valid)
+		return &s[1];
+	return &s[(h >> 40) & 1];
+}
+
+/*
+ * Map the on-disk store, creating it if the file is new or empty.
+ * Any other file must be a store for the same tile size and number
+ * of slots; it is never overwritten.
+ */
+static void tile_disk_open(struct tile_cache *c, const char *file, size_t nslots)
+{
+	int fd;
+	struct stat st;
+	struct tile_disk *d, hdr;
+	size_t len;
+
+	nslots += nslots % 2;
+	len = sizeof(*d) + nslots * sizeof(d->slot[0]);
+
+	fd = open(file, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(file);
+		exit(1);
+	}
+	if (st.st_size != 0 && (st.st_size != len ||
+	    pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.magic, TILE_DISK_MAGIC, 8) != 0 ||
+	    hdr.tile_size != TILE_SIZE || hdr.nslots != nslots)) {
+		fprintf(stderr, "%s: not a tile cache of %zd %dx%d tiles, "
+			"refusing to overwrite it\n", file, nslots, TILE_SIZE, TILE_SIZE);
+		exit(1);
+	}
+	if (st.st_size == 0 && ftruncate(fd, len) < 0) {
+		perror("tile_disk_open: ftruncate");
+		exit(1);
+	}
+
+	d = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (d == MAP_FAILED) {
+		perror("tile_disk_open: mmap");
+		exit(1);
+	}
+	close(fd);
+
+	if (st.st_size == 0) {
+		memset(d, 0, len);
+		d->tile_size = TILE_SIZE;
+		d->nslots = nslots;
+		memcpy(d->magic, TILE_DISK_MAGIC, 8);
+	}
+
+	c->disk = d;
+	c->disk_slots = nslots;
+	c->disk_len = len;
+}
+
+/*
+ * Set up a cache of up to 'capacity' tiles in memory,
+ * and of 'disk_slots' tiles in 'disk_file', if not NULL.
+ */
+void tile_cache_init(struct tile_cache *c, int capacity,
+	const char *disk_file, size_t disk_slots)
+{
+	pthread_mutex_init(&c->mutex, NULL);
+	pthread_cond_init(&c->filled, NULL);
+
+	c->capacity = capacity;
+	c->count = 0;
+	c->nbuckets = 2 * capacity + 1;
+	c->buckets = sync_malloc(c->nbuckets * sizeof(*c->buckets));
+	memset(c->buckets, 0, c->nbuckets * sizeof(*c->buckets));
+	c->lru.prev = c->lru.next = &c->lru;
+
+	c->disk = NULL;
+	if (disk_file)
+		tile_disk_open(c, disk_file, disk_slots);
+
+	c->hits = c->disk_hits = c->misses = 0;
+}
+
+void tile_cache_destroy(struct tile_cache *c)
+{
+	struct tile_entry *e, *next;
+
+	for (e = c->lru.next; e != &c->lru; e = next) {
+		next = e->next;
+		free(e);
+	}
+	free(c->buckets);
+	if (c->disk)
+		munmap(c->disk, c->disk_len);
+}
+
+static void lru_unlink(struct tile_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void lru_push_front(struct tile_cache *c, struct tile_entry *e)
+{
+	e->prev = &c->lru;
+	e->next = c->lru.next;
+	e->next->prev = e;
+	c->lru.next = e;
+}
+
+static void hash_remove(struct tile_cache *c, struct tile_entry *e)
+{
+	struct tile_entry **pp;
+
+	for (pp = &c->buckets[tile_hash(&e->key) % c->nbuckets]; *pp != e;
+	     pp = &(*pp)->hnext)
+		;
+	*pp = e->hnext;
+}
+
+/*
+ * Find room for one more tile: evict the least recently used tile
+ * nobody is using, or allocate a new one if under capacity, or if
+ * every tile is in use.
+ */
+static struct tile_entry *tile_alloc(struct tile_cache *c)
+{
+	struct tile_entry *e;
+
+	if (c->count >= c->capacity)
+		for (e = c->lru.prev; e != &c->lru; e = e->prev)
+			if (e->pins == 0) {
+				lru_unlink(e);
+				hash_remove(c, e);
+				return e;
+			}
+
+	c->count++;
+	return sync_malloc(sizeof(*e));
+}
+
+/*
+ * Return the iteration counts of a tile, calling fill() to compute
+ * them if the tile is neither in memory nor on disk. If another thread
+ * is already computing the same tile, wait for it instead.
+ * The tile stays in memory until released with tile_cache_release().
+ */
+const uint16_t *tile_cache_get(struct tile_cache *c, const struct tile_key *key,
+	tile_fill_fn *fill, void *arg)
+{
+	unsigned long h = tile_hash(key);
+	struct tile_entry *e;
+	struct tile_disk_slot *slot = NULL;
+	int found;
+
+	pthread_mutex_lock(&c->mutex);
+
+	for (e = c->buckets[h % c->nbuckets]; e; e = e->hnext)
+		if (tile_key_equal(&e->key, key))
+			break;
+
+	if (e) {
+		c->hits++;
+		e->pins++;
+		lru_unlink(e);
+		lru_push_front(c, e);
+		while (!e->ready)
+			pthread_cond_wait(&c->filled, &c->mutex);
+		pthread_mutex_unlock(&c->mutex);
+		return e->iter;
+	}
+
+	e = tile_alloc(c);
+	e->key = *key;
+	e->pins = 1;
+	e->ready = 0;
+	e->hnext = c->buckets[h % c->nbuckets];
+	c->buckets[h % c->nbuckets] = e;
+	lru_push_front(c, e);
+
+	if (c->disk) {
+		slot = tile_disk_slot(c, key, h, &found);
+		if (found) {
+			memcpy(e->iter, slot->iter, sizeof(e->iter));
+			e->ready = 1;
+			c->disk_hits++;
+			pthread_mutex_unlock(&c->mutex);
+			return e->iter;
+		}
+	}
+
+	c->misses++;
+	pthread_mutex_unlock(&c->mutex);
+
+	fill(key, e->iter, arg);
+
+	pthread_mutex_lock(&c->mutex);
+	if (slot) {
+		/* Another tile may have taken the slot meanwhile, pick again */
+		slot = tile_disk_slot(c, key, h, &found);
+		slot->key = *key;
+		memcpy(slot->iter, e->iter, sizeof(e->iter));
+		slot->valid = 1;
+	}
+	e->ready = 1;
+	pthread_cond_broadcast(&c->filled);
+	pthread_mutex_unlock(&c->mutex);
+
+	return e->iter;
+}
+
+void tile_cache_release(struct tile_cache *c, const uint16_t *iter)
+{
+	struct tile_entry *e;
+
+	e = (struct tile_entry *)((char *)iter - offsetof(struct tile_entry, iter));
+
+	pthread_mutex_lock(&c->mutex);
+	e->pins--;
+	pthread_mutex_unlock(&c->mutex);
+}
@@ -0,0 +1,71 @@
+/*
+ * mandel-cache.h
+ *
+ * A cache of Mandelbrot Set tiles, so overlapping or repeated
+ * views only compute the tiles they have not seen before.
+ *
+ */
+
+#ifndef MANDEL_CACHE_H__
+#define MANDEL_CACHE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Tiles are TILE_SIZE x TILE_SIZE points */
+#define TILE_SIZE 64
+
+/*
+ * Tiles live on a fixed grid of the complex plane.
+ * At zoom level 'level' points are (TILE_BASE_STEP / 2^level) units apart,
+ * and tile (tx, ty) covers points (tx * TILE_SIZE + i, ty * TILE_SIZE + j)
+ * of the grid, for i, j in 0 .. TILE_SIZE-1. Grid y grows downwards.
+ */
+#define TILE_BASE_STEP (4.0 / TILE_SIZE)
+
+struct tile_key {
+	int64_t tx, ty;
+	int32_t level;
+	int32_t max_iter;
+};
+
+/* An in-memory tile; the cache keeps them in LRU order */
+struct tile_entry {
+	struct tile_key key;
+	struct tile_entry *hnext;       /* Next entry in the same hash bucket */
+	struct tile_entry *prev, *next; /* LRU list, most recently used first */
+	int pins;                       /* Number of users, cannot be evicted */
+	int ready;                      /* iter[] has been filled */
+	uint16_t iter[TILE_SIZE * TILE_SIZE]; /* Iteration counts, saturated */
+};
+
+struct tile_disk;
+
+struct tile_cache {
+	pthread_mutex_t mutex;
+	pthread_cond_t filled;          /* Broadcast when a tile becomes ready */
+
+	int capacity, count;
+	int nbuckets;
+	struct tile_entry **buckets;
+	struct tile_entry lru;          /* List head */
+
+	struct tile_disk *disk;         /* Optional on-disk store, or NULL */
+	size_t disk_slots;
+	size_t disk_len;
+
+	long hits, disk_hits, misses;
+};
+
+/* Computes the iteration counts of a tile that is not in the cache */
+typedef void tile_fill_fn(const struct tile_key *key, uint16_t *iter, void *arg);
+
+/* Function prototypes */
+void tile_cache_init(struct tile_cache *c, int capacity,
+	const char *disk_file, size_t disk_slots);
+void tile_cache_destroy(struct tile_cache *c);
+const uint16_t *tile_cache_get(struct tile_cache *c, const struct tile_key *key,
+	tile_fill_fn *fill, void *arg);
+void tile_cache_release(struct tile_cache *c, const uint16_t *iter);
+
+#endif /* MANDEL_CACHE_H__ */
@@ -0,0 +1,72 @@
+/*
+ * mandel-color-bench.c
+ *
+ * A micro-benchmark for the color mapping functions of mandel-lib:
+ * compares the full colortable search of xterm_color_search()
+ * with the precomputed table lookup of xterm_color().
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "mandel-lib.h"
+
+#define DEFAULT_CALLS 10000000
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	long i, calls, search_calls;
+	unsigned int sum;
+	double t0, t_search, t_table;
+
+	calls = (argc > 1) ? atol(argv[1]) : DEFAULT_CALLS;
+	if (calls <= 0) {
+		fprintf(stderr, "Usage: %s [calls]\n", argv[0]);
+		exit(1);
+	}
+
+	/*
+	 * Both functions must agree on every possible color value.
+	 * This also makes sure the table is built before timing starts.
+	 */
+	for (i = 0; i < 256; i++)
+		if (xterm_color(i) != xterm_color_search(i)) {
+			fprintf(stderr, "Internal error: xterm_color(%ld) = %d, not %d\n",
+				i, xterm_color(i), xterm_color_search(i));
+			exit(1);
+		}
+
+	/* The search is slow, do not wait for all of the calls */
+	search_calls = calls / 100 + 1;
+
+	sum = 0;
+	t0 = now_sec();
+	for (i = 0; i < search_calls; i++)
+		sum += xterm_color_search(i & 255);
+	t_search = now_sec() - t0;
+
+	t0 = now_sec();
+	for (i = 0; i < calls; i++)
+		sum += xterm_color(i & 255);
+	t_table = now_sec() - t0;
+
+	printf("xterm_color_search: %10ld calls, %10.2f ns/call\n",
+		search_calls, t_search * 1e9 / search_calls);
+	printf("xterm_color:        %10ld calls, %10.2f ns/call\n",
+		calls, t_table * 1e9 / calls);
+	printf("speedup: %.0fx (checksum %u)\n",
+		(t_search / search_calls) / (t_table / calls), sum);
+
+	return 0;
+}
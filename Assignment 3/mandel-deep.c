@@ -0,0 +1,270 @@
+/*
+ * mandel-deep.c
+ *
+ * A library for deep zooms into the Mandelbrot Set,
+ * using perturbation theory.
+ *
+ * Plain double precision runs out of bits below zooms of about 1e-13:
+ * neighbouring pixels end up on the same double. Instead, a single
+ * reference orbit Z_n is computed for the center of the view, in
+ * double-double precision. Every pixel C + dc is then iterated as
+ * a perturbation dz_n from that orbit, z_n = Z_n + dz_n, with
+ *
+ *     dz_n+1 = 2 * Z_n * dz_n + dz_n^2 + dc
+ *
+ * which only involves small numbers, so double precision is enough.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "mandel-deep.h"
+
+/*********************************
+ *                               *
+ * Double-double arithmetic      *
+ *                               *
+ *********************************/
+
+/* a + b, exactly, assuming |a| >= |b| */
+static dd_t quick_two_sum(double a, double b)
+{
+	dd_t r;
+
+	r.hi = a + b;
+	r.lo = b - (r.hi - a);
+	return r;
+}
+
+/* a + b, exactly */
+static dd_t two_sum(double a, double b)
+{
+	dd_t r;
+	double bb;
+
+	r.hi = a + b;
+	bb = r.hi - a;
+	r.lo = (a - (r.hi - bb)) + (b - bb);
+	return r;
+}
+
+/* a * b, exactly */
+static dd_t two_prod(double a, double b)
+{
+	dd_t r;
+
+	r.hi = a * b;
+	r.lo = fma(a, b, -r.hi);
+	return r;
+}
+
+dd_t dd_from_double(double a)
+{
+	dd_t r = { a, 0.0 };
+	return r;
+}
+
+dd_t dd_add(dd_t a, dd_t b)
+{
+	dd_t s, t;
+
+	s = two_sum(a.hi, b.hi);
+	t = two_sum(a.lo, b.lo);
+	s.lo += t.hi;
+	s = quick_two_sum(s.hi, s.lo);
+	s.lo += t.lo;
+	return quick_two_sum(s.hi, s.lo);
+}
+
+dd_t dd_sub(dd_t a, dd_t b)
+{
+	b.hi = -b.hi;
+	b.lo = -b.lo;
+	return dd_add(a, b);
+}
+
+dd_t dd_mul(dd_t a, dd_t b)
+{
+	dd_t p;
+
+	p = two_prod(a.hi, b.hi);
+	p.lo += a.hi * b.lo + a.lo * b.hi;
+	return quick_two_sum(p.hi, p.lo);
+}
+
+dd_t dd_mul_d(dd_t a, double b)
+{
+	dd_t p;
+
+	p = two_prod(a.hi, b);
+	p.lo += a.lo * b;
+	return quick_two_sum(p.hi, p.lo);
+}
+
+static dd_t dd_div_d(dd_t a, double b)
+{
+	double q1, q2;
+	dd_t r;
+
+	q1 = a.hi / b;
+	r = dd_sub(a, two_prod(q1, b));
+	q2 = r.hi / b;
+	return quick_two_sum(q1, q2);
+}
+
+/*
+ * Convert a decimal number, with an optional exponent, to double-double,
+ * keeping all of its digits. Like strtod(), *endp is set to the first
+ * character not converted, or to s if there is no number at all.
+ */
+dd_t dd_from_string(const char *s, char **endp)
+{
+	const char *p = s;
+	dd_t v = dd_from_double(0.0);
+	int neg = 0, digits = 0, scale = 0, exp = 0, eneg = 0;
+
+	while (isspace((unsigned char)*p))
+		p++;
+	if (*p == '-' || *p == '+')
+		neg = (*p++ == '-');
+
+	for (; isdigit((unsigned char)*p); p++, digits++)
+		v = dd_add(dd_mul_d(v, 10.0), dd_from_double(*p - '0'));
+	if (*p == '.')
+		for (p++; isdigit((unsigned char)*p); p++, digits++, scale--)
+			v = dd_add(dd_mul_d(v, 10.0), dd_from_double(*p - '0'));
+
+	if (digits == 0) {
+		if (endp)
+			*endp = (char *)s;
+		return dd_from_double(0.0);
+	}
+
+	if ((*p == 'e' || *p == 'E') &&
+	    (isdigit((unsigned char)p[1]) ||
+	     ((p[1] == '-' || p[1] == '+') && isdigit((unsigned char)p[2])))) {
+		p++;
+		if (*p == '-' || *p == '+')
+			eneg = (*p++ == '-');
+		for (; isdigit((unsigned char)*p); p++)
+			exp = exp * 10 + (*p - '0');
+		scale += eneg ? -exp : exp;
+	}
+
+	for (; scale > 0; scale--)
+		v = dd_mul_d(v, 10.0);
+	for (; scale < 0; scale++)
+		v = dd_div_d(v, 10.0);
+
+	if (endp)
+		*endp = (char *)p;
+	if (neg) {
+		v.hi = -v.hi;
+		v.lo = -v.lo;
+	}
+	return v;
+}
+
+/*********************************
+ *                               *
+ * Perturbation                  *
+ *                               *
+ *********************************/
+
+/*
+ * Compute the reference orbit of point (cx, cy), for up to max
+ * iterations. The arrays of a previous orbit are reused.
+ */
+void mandel_orbit_compute(struct mandel_orbit *o, dd_t cx, dd_t cy, int max)
+{
+	dd_t x, y, xx, yy;
+	int n;
+
+	if (o->alloc < max + 1) {
+		free(o->zx);
+		free(o->zy);
+		o->zx = malloc((max + 1) * sizeof(*o->zx));
+		o->zy = malloc((max + 1) * sizeof(*o->zy));
+		if (o->zx == NULL || o->zy == NULL) {
+			fprintf(stderr, "Out of memory, failed to allocate "
+				"a reference orbit of %d iterations\n", max);
+			exit(1);
+		}
+		o->alloc = max + 1;
+	}
+
+	o->cx = cx;
+	o->cy = cy;
+
+	x = y = dd_from_double(0.0);
+	o->zx[0] = o->zy[0] = 0.0;
+	for (n = 1; n <= max; n++) {
+		xx = dd_mul(x, x);
+		yy = dd_mul(y, y);
+		y = dd_add(dd_mul_d(dd_mul(x, y), 2.0), cy);
+		x = dd_add(dd_sub(xx, yy), cx);
+
+		o->zx[n] = x.hi;
+		o->zy[n] = y.hi;
+		if (x.hi * x.hi + y.hi * y.hi > 4)
+			break;
+	}
+	o->len = (n > max) ? max : n;
+}
+
+void mandel_orbit_free(struct mandel_orbit *o)
+{
+	free(o->zx);
+	free(o->zy);
+	o->zx = o->zy = NULL;
+	o->alloc = 0;
+}
+
+/*
+ * Iterate point C + (dcx, dcy) as a perturbation of the reference orbit o
+ * (which must be at least max iterations long, unless it escaped).
+ * The return value matches what mandel_iterations_at_point() would
+ * return for the same point, had it enough precision.
+ *
+ * A glitch happens when z_n gets closer to 0 than dz_n is: the
+ * perturbation is then larger than the value itself, and its rounding
+ * errors take over. When this is detected, or when the reference orbit
+ * escapes or runs out, the orbit is rebased: since Z_0 = 0, z_n itself
+ * can serve as a perturbation from Z_0 and iteration continues from
+ * there. The number of rebases is added to *glitches.
+ */
+int mandel_perturb_iterations(const struct mandel_orbit *o,
+	double dcx, double dcy, int max, int *glitches)
+{
+	int n = 0, iter = 0;
+	double dx = 0, dy = 0;
+	double tx, ty, zx, zy, mag;
+
+	while (iter < max) {
+		tx = 2 * o->zx[n] + dx;
+		ty = 2 * o->zy[n] + dy;
+		zx = tx * dx - ty * dy + dcx;
+		dy = tx * dy + ty * dx + dcy;
+		dx = zx;
+		n++;
+		iter++;
+
+		zx = o->zx[n] + dx;
+		zy = o->zy[n] + dy;
+		mag = zx * zx + zy * zy;
+		if (mag > 4)
+			return iter - 1;
+
+		if (mag < dx * dx + dy * dy || n == o->len) {
+			dx = zx;
+			dy = zy;
+			n = 0;
+			++*glitches;
+		}
+	}
+
+	return max;
+}
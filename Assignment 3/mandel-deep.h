@@ -0,0 +1,48 @@
+/*
+ * mandel-deep.h
+ *
+ * A library for deep zooms into the Mandelbrot Set,
+ * using perturbation theory.
+ *
+ */
+
+#ifndef MANDEL_DEEP_H__
+#define MANDEL_DEEP_H__
+
+/*
+ * A double-double number: the unevaluated sum hi + lo,
+ * with |lo| <= ulp(hi) / 2, for about 106 bits of mantissa.
+ * This is enough for zooms down to about 1e-30.
+ */
+typedef struct {
+	double hi;
+	double lo;
+} dd_t;
+
+/*
+ * A reference orbit: the iterations Z_0 = 0, Z_n+1 = Z_n^2 + C
+ * of a single point C, computed in double-double precision,
+ * then rounded to double for use by mandel_perturb_iterations().
+ */
+struct mandel_orbit {
+	dd_t cx, cy;    /* The reference point C */
+	int len;        /* Z_len escaped, or len is the maximum iteration count */
+	int alloc;
+	double *zx;     /* Z_0 .. Z_len */
+	double *zy;
+};
+
+/* Function prototypes */
+dd_t dd_from_double(double a);
+dd_t dd_from_string(const char *s, char **endp);
+dd_t dd_add(dd_t a, dd_t b);
+dd_t dd_sub(dd_t a, dd_t b);
+dd_t dd_mul(dd_t a, dd_t b);
+dd_t dd_mul_d(dd_t a, double b);
+
+void mandel_orbit_compute(struct mandel_orbit *o, dd_t cx, dd_t cy, int max);
+void mandel_orbit_free(struct mandel_orbit *o);
+int mandel_perturb_iterations(const struct mandel_orbit *o,
+	double dcx, double dcy, int max, int *glitches);
+
+#endif /* MANDEL_DEEP_H__ */
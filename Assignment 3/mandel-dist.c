@@ -0,0 +1,909 @@
+/*
+ * mandel-dist.c
+ *
+ * A program to render the Mandelbrot Set into a PPM/PGM image,
+ * with worker processes on this or other hosts.
+ *
+ * The coordinator splits the image into tiles and hands them out to
+ * the workers that connect to it, over a UNIX-domain or TCP socket.
+ * Workers send back the finished pixels of every tile, which the
+ * coordinator receives straight into the memory-mapped image: every
+ * row of a tile is an iovec into the file's pages, so the pixels are
+ * copied once, from the socket into the page cache.
+ *
+ * A worker may die, or stall, at any time: its tiles are handed out
+ * again to the others. New workers may join at any time too.
+ * The coordinator never waits on any one worker: its sockets are
+ * non-blocking, and it keeps how far along every connection is with
+ * the message it is receiving, taking in whatever poll() says is there.
+ *
+ * The protocol is a sequence of messages, each a struct dist_hdr followed
+ * by 'len' bytes of payload, in the byte order of the coordinator.
+ * A worker on a host with the other byte order is told apart by the
+ * magic number of its HELLO, and turned away.
+ *
+ *     worker                          coordinator
+ *     HELLO  { magic, version }  -->
+ *                                <--  VIEW   { view, max_iter, bpp }
+ *                                <--  TILE   { id, x, y, w, h }
+ *     RESULT { id }, pixels      -->
+ *     ...
+ *                                     (close, once the image is done)
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "mandel-lib.h"
+#include "proc-common.h"
+
+#define MANDEL_MAX_ITERATION 100000
+
+#define DIST_MAGIC 0x4d444953   /* "MDIS" */
+#define DIST_VERSION 1
+#define DIST_INFLIGHT 2         /* Tiles handed to a worker at a time */
+#define DIST_MAX_WORKERS 256
+#define DIST_MAX_TILE IOV_MAX   /* A row of a tile is an iovec */
+
+enum { MSG_HELLO = 1, MSG_VIEW, MSG_TILE, MSG_RESULT };
+
+struct dist_hdr {
+	uint32_t type;
+	uint32_t len;           /* Bytes of payload that follow */
+};
+
+struct dist_hello {
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct dist_view {
+	double xmin, ymax;      /* Upper left corner */
+	double xstep, ystep;    /* Size of a pixel */
+	int32_t max_iter;
+	int32_t bpp;            /* 1 for PGM, 3 for PPM */
+};
+
+struct dist_tile {
+	int32_t id;
+	int32_t x, y, w, h;
+};
+
+/* A RESULT is a struct dist_result, followed by h rows of w * bpp bytes */
+struct dist_result {
+	int32_t id;
+};
+
+/*
+ * Coordinator state
+ */
+enum { TILE_PENDING, TILE_ISSUED, TILE_DONE };
+
+struct tile {
+	int x, y, w, h;
+	int state;
+};
+
+/* What the coordinator is receiving from a worker */
+enum { RECV_HELLO, RECV_RESULT, RECV_ROWS };
+
+struct worker {
+	int fd;
+	int stage;                      /* RECV_* */
+	char msg[sizeof(struct dist_hdr) + sizeof(struct dist_hello)];
+	size_t got, want;               /* Bytes of msg received, and expected */
+	struct iovec *iov;              /* Rows of the tile being received */
+	int row, nrows;                 /* First row not yet filled, and all */
+	int inflight[DIST_INFLIGHT];    /* Tiles handed out, oldest first */
+	int ninflight;
+	double since;                   /* Connected, or last tile handed out
+	                                   or received */
+	long tiles;
+};
+
+struct tile *tiles;
+int ntiles, tiles_done = 0;
+int *requeue, nrequeue = 0;     /* Tiles taken back from lost workers */
+int next_tile = 0;              /* Tiles from here on were never handed out */
+long reissued = 0;
+
+struct worker workers[DIST_MAX_WORKERS];
+int nworkers = 0;
+long workers_seen = 0, workers_lost = 0;
+
+/* Options */
+int x_chars = 1024, y_chars = 768;
+double center_x = -0.4, center_y = 0.0, zoom = 1.0;
+int max_iteration = MANDEL_MAX_ITERATION;
+int tile_size = 64;
+int local_workers = 0;
+double timeout = 30.0;
+int die_after = -1;
+
+struct dist_view view;
+
+char *image_file = NULL;
+unsigned char *image_map;
+size_t image_len;
+unsigned char *image_pixels;
+
+double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *safe_malloc(size_t size)
+{
+	void *p;
+
+	if ((p = malloc(size)) == NULL) {
+		fprintf(stderr, "Out of memory, failed to allocate %zd bytes\n",
+			size);
+		exit(1);
+	}
+
+	return p;
+}
+
+/*********************************
+ *                               *
+ * Messages                      *
+ *                               *
+ *********************************/
+
+/* Send all of buf, return -1 if the peer is gone */
+int send_all(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+	const char *p = buf;
+
+	while (len > 0) {
+		ret = send(fd, p, len, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Account for 'bytes' received into the n iovecs: trim the first one
+ * not completely filled, and return how many were.
+ */
+int iov_advance(struct iovec *iov, int n, size_t bytes)
+{
+	int i;
+
+	for (i = 0; i < n && bytes >= iov[i].iov_len; i++)
+		bytes -= iov[i].iov_len;
+	if (i < n) {
+		iov[i].iov_base = (char *)iov[i].iov_base + bytes;
+		iov[i].iov_len -= bytes;
+	}
+	return i;
+}
+
+/*
+ * Fill all of the n iovecs, which are modified on the way.
+ * Return -1 on end of file or error.
+ */
+int recv_iov(int fd, struct iovec *iov, int n)
+{
+	struct msghdr msg;
+	ssize_t ret;
+	int i;
+
+	memset(&msg, 0, sizeof(msg));
+	while (n > 0) {
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+		ret = recvmsg(fd, &msg, MSG_WAITALL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		i = iov_advance(iov, n, ret);
+		iov += i;
+		n -= i;
+	}
+	return 0;
+}
+
+/*
+ * Receive into the n iovecs whatever has arrived, without waiting.
+ * Return the number of bytes, 0 if there were none yet,
+ * or -1 on end of file or error.
+ */
+ssize_t recv_ready(int fd, struct iovec *iov, int n)
+{
+	struct msghdr msg;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+	do {
+		ret = recvmsg(fd, &msg, MSG_DONTWAIT);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (ret <= 0)
+		return -1;
+	return ret;
+}
+
+int recv_all(int fd, void *buf, size_t len)
+{
+	struct iovec iov = { buf, len };
+
+	return recv_iov(fd, &iov, 1);
+}
+
+int send_msg(int fd, uint32_t type, const void *payload, uint32_t len)
+{
+	char buf[sizeof(struct dist_hdr) + 64];
+	struct dist_hdr hdr = { type, len };
+
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), payload, len);
+	return send_all(fd, buf, sizeof(hdr) + len);
+}
+
+/* Receive a message of a known type and size */
+int recv_msg(int fd, uint32_t type, void *payload, uint32_t len)
+{
+	struct dist_hdr hdr;
+
+	if (recv_all(fd, &hdr, sizeof(hdr)) < 0 ||
+	    hdr.type != type || hdr.len != len)
+		return -1;
+	return recv_all(fd, payload, len);
+}
+
+/*
+ * Create a socket for an address: "host:port" for TCP,
+ * anything else is the path of a UNIX-domain socket.
+ * Either listen on it, or connect to it.
+ */
+int dist_socket(const char *addr, int listening)
+{
+	struct addrinfo hints, *res, *ai;
+	struct sockaddr_un sun;
+	char host[256];
+	const char *port;
+	int fd = -1, one = 1, ret;
+
+	port = strrchr(addr, ':');
+	if (port == NULL) {
+		if (strlen(addr) >= sizeof(sun.sun_path)) {
+			fprintf(stderr, "%s: socket path too long\n", addr);
+			exit(1);
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, addr);
+
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+			perror("socket");
+			exit(1);
+		}
+		if (listening) {
+			unlink(addr);
+			ret = bind(fd, (struct sockaddr *)&sun, sizeof(sun));
+		} else {
+			ret = connect(fd, (struct sockaddr *)&sun, sizeof(sun));
+		}
+		if (ret < 0) {
+			perror(addr);
+			exit(1);
+		}
+	} else {
+		snprintf(host, sizeof(host), "%.*s", (int)(port - addr), addr);
+		port++;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = listening ? AI_PASSIVE : 0;
+		ret = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", addr, gai_strerror(ret));
+			exit(1);
+		}
+		for (ai = res; ai; ai = ai->ai_next) {
+			fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if (fd < 0)
+				continue;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (listening ? bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 :
+					connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(res);
+		if (fd < 0) {
+			fprintf(stderr, "%s: cannot %s\n", addr,
+				listening ? "bind" : "connect");
+			exit(1);
+		}
+		/* Tile requests are tiny, do not hold them back */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	if (listening && listen(fd, 64) < 0) {
+		perror("listen");
+		exit(1);
+	}
+	return fd;
+}
+
+/*********************************
+ *                               *
+ * Worker                        *
+ *                               *
+ *********************************/
+
+/* Compute the pixels of a tile, row after row */
+void compute_tile(const struct dist_view *v, const struct dist_tile *t,
+	unsigned char *pix)
+{
+	int iter[t->w];
+	int r, i, val;
+
+	for (r = 0; r < t->h; r++) {
+		mandel_iterations_row(v->xmin + v->xstep * t->x, v->xstep,
+			v->ymax - v->ystep * (t->y + r), t->w, v->max_iter, iter);
+		for (i = 0; i < t->w; i++, pix += v->bpp) {
+			val = (iter[i] > 255) ? 255 : iter[i];
+			if (v->bpp == 1)
+				*pix = val;
+			else
+				mandel_rgb(val, pix);
+		}
+	}
+}
+
+/*
+ * Connect to the coordinator and compute the tiles it hands out,
+ * until it closes the connection. With die_after >= 0, exit after
+ * that many tiles, halfway through sending the next one.
+ */
+void worker(const char *addr, int die_after)
+{
+	struct dist_hello hello = { DIST_MAGIC, DIST_VERSION };
+	struct dist_view v;
+	struct dist_tile t;
+	struct dist_hdr hdr;
+	struct dist_result res;
+	unsigned char *pix = NULL;
+	size_t len, alloc = 0;
+	int fd, done = 0;
+
+	fd = dist_socket(addr, 0);
+	if (send_msg(fd, MSG_HELLO, &hello, sizeof(hello)) < 0 ||
+	    recv_msg(fd, MSG_VIEW, &v, sizeof(v)) < 0 ||
+	    (v.bpp != 1 && v.bpp != 3) || v.max_iter <= 0) {
+		fprintf(stderr, "Worker %ld: handshake with %s failed\n",
+			(long)getpid(), addr);
+		exit(1);
+	}
+
+	while (recv_msg(fd, MSG_TILE, &t, sizeof(t)) == 0) {
+		/* compute_tile() keeps a row of iterations on the stack */
+		if (t.w <= 0 || t.h <= 0 || t.w > DIST_MAX_TILE || t.h > DIST_MAX_TILE) {
+			fprintf(stderr, "Worker %ld: bad %dx%d tile from %s\n",
+				(long)getpid(), t.w, t.h, addr);
+			exit(1);
+		}
+		len = (size_t)t.w * t.h * v.bpp;
+		if (len > alloc) {
+			free(pix);
+			pix = safe_malloc(len);
+			alloc = len;
+		}
+		compute_tile(&v, &t, pix);
+
+		hdr.type = MSG_RESULT;
+		hdr.len = sizeof(res) + len;
+		res.id = t.id;
+		if (die_after >= 0 && done == die_after)
+			len /= 2;
+		if (send_all(fd, &hdr, sizeof(hdr)) < 0 ||
+		    send_all(fd, &res, sizeof(res)) < 0 ||
+		    send_all(fd, pix, len) < 0)
+			break;
+		if (die_after >= 0 && done == die_after) {
+			fprintf(stderr, "Worker %ld: exiting after %d tiles, as asked\n",
+				(long)getpid(), done);
+			exit(1);
+		}
+		done++;
+	}
+
+	free(pix);
+	close(fd);
+	exit(0);
+}
+
+/*********************************
+ *                               *
+ * Coordinator                   *
+ *                               *
+ *********************************/
+
+void image_open(char *file)
+{
+	int fd, hlen;
+	char header[64];
+	size_t len = strlen(file);
+
+	view.bpp = (len >= 4 && strcmp(file + len - 4, ".pgm") == 0) ? 1 : 3;
+	hlen = snprintf(header, sizeof(header), "P%d\n%d %d\n255\n",
+		view.bpp == 1 ? 5 : 6, x_chars, y_chars);
+	image_len = hlen + (size_t)x_chars * y_chars * view.bpp;
+
+	fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(file);
+		exit(1);
+	}
+	if (ftruncate(fd, image_len) < 0) {
+		perror("image_open: ftruncate");
+		exit(1);
+	}
+	image_map = mmap(NULL, image_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (image_map == MAP_FAILED) {
+		perror("image_open: mmap");
+		exit(1);
+	}
+	close(fd);
+
+	memcpy(image_map, header, hlen);
+	image_pixels = image_map + hlen;
+}
+
+void make_tiles(void)
+{
+	int x, y, i = 0;
+
+	ntiles = ((x_chars + tile_size - 1) / tile_size) *
+		((y_chars + tile_size - 1) / tile_size);
+	tiles = safe_malloc(ntiles * sizeof(*tiles));
+	requeue = safe_malloc(ntiles * sizeof(*requeue));
+
+	for (y = 0; y < y_chars; y += tile_size)
+		for (x = 0; x < x_chars; x += tile_size, i++) {
+			tiles[i].x = x;
+			tiles[i].y = y;
+			tiles[i].w = (x + tile_size <= x_chars) ? tile_size : x_chars - x;
+			tiles[i].h = (y + tile_size <= y_chars) ? tile_size : y_chars - y;
+			tiles[i].state = TILE_PENDING;
+		}
+}
+
+/* The next tile to hand out, or -1 if there is none */
+int pending_tile(void)
+{
+	if (nrequeue > 0)
+		return requeue[--nrequeue];
+	if (next_tile < ntiles)
+		return next_tile++;
+	return -1;
+}
+
+/* Drop a worker, and hand its unfinished tiles to the others */
+void worker_lost(int w, const char *why)
+{
+	struct worker *wk = &workers[w];
+	int i, id;
+
+	if (wk->stage == RECV_HELLO) {
+		fprintf(stderr, "Turned away a worker (%s)\n", why);
+	} else {
+		fprintf(stderr, "Worker on fd %d lost (%s), after %ld tiles; "
+			"re-issuing %d tiles\n", wk->fd, why, wk->tiles, wk->ninflight);
+		workers_lost++;
+	}
+	for (i = 0; i < wk->ninflight; i++) {
+		id = wk->inflight[i];
+		tiles[id].state = TILE_PENDING;
+		requeue[nrequeue++] = id;
+		reissued++;
+	}
+	close(wk->fd);
+	free(wk->iov);
+	*wk = workers[--nworkers];
+}
+
+/* Take in every new connection; they start out waiting for a HELLO */
+void worker_accept(int lfd)
+{
+	struct worker *wk;
+	int fd;
+
+	while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		if (nworkers == DIST_MAX_WORKERS) {
+			fprintf(stderr, "Turned away a worker (too many)\n");
+			close(fd);
+			continue;
+		}
+		wk = &workers[nworkers++];
+		wk->fd = fd;
+		wk->stage = RECV_HELLO;
+		wk->got = 0;
+		wk->want = sizeof(struct dist_hdr) + sizeof(struct dist_hello);
+		wk->iov = safe_malloc(tile_size * sizeof(*wk->iov));
+		wk->ninflight = 0;
+		wk->since = now_sec();
+		wk->tiles = 0;
+	}
+}
+
+/* A whole HELLO is in: check it, and tell the worker what to render */
+int worker_hello(struct worker *wk)
+{
+	struct dist_hdr hdr;
+	struct dist_hello hello;
+
+	memcpy(&hdr, wk->msg, sizeof(hdr));
+	memcpy(&hello, wk->msg + sizeof(hdr), sizeof(hello));
+	if (hdr.type != MSG_HELLO || hdr.len != sizeof(hello) ||
+	    hello.magic != DIST_MAGIC || hello.version != DIST_VERSION ||
+	    send_msg(wk->fd, MSG_VIEW, &view, sizeof(view)) < 0)
+		return -1;
+
+	wk->stage = RECV_RESULT;
+	wk->got = 0;
+	wk->want = sizeof(struct dist_hdr) + sizeof(struct dist_result);
+	wk->since = now_sec();
+	workers_seen++;
+	return 0;
+}
+
+/*
+ * The header of a RESULT is in: check it is for the worker's oldest
+ * tile, and set up to receive the rows straight into the image.
+ */
+int worker_result(struct worker *wk)
+{
+	struct dist_hdr hdr;
+	struct dist_result res;
+	struct tile *t;
+	int r;
+
+	memcpy(&hdr, wk->msg, sizeof(hdr));
+	memcpy(&res, wk->msg + sizeof(hdr), sizeof(res));
+
+	/* Workers return tiles in the order they got them */
+	if (wk->ninflight == 0 || hdr.type != MSG_RESULT || res.id != wk->inflight[0])
+		return -1;
+	t = &tiles[res.id];
+	if (hdr.len != sizeof(res) + (size_t)t->w * t->h * view.bpp)
+		return -1;
+
+	for (r = 0; r < t->h; r++) {
+		wk->iov[r].iov_base = image_pixels +
+			((size_t)(t->y + r) * x_chars + t->x) * view.bpp;
+		wk->iov[r].iov_len = (size_t)t->w * view.bpp;
+	}
+	wk->stage = RECV_ROWS;
+	wk->row = 0;
+	wk->nrows = t->h;
+	return 0;
+}
+
+/* Every row of the worker's oldest tile is in */
+void worker_tile_done(struct worker *wk)
+{
+	struct tile *t = &tiles[wk->inflight[0]];
+
+	t->state = TILE_DONE;
+	tiles_done++;
+	wk->tiles++;
+	wk->ninflight--;
+	memmove(wk->inflight, wk->inflight + 1, wk->ninflight * sizeof(int));
+	wk->since = now_sec();
+
+	wk->stage = RECV_RESULT;
+	wk->got = 0;
+}
+
+/*
+ * Take in whatever a worker has sent, without waiting for more,
+ * and act on every message completed. Return -1 if the worker
+ * is to be dropped.
+ */
+int worker_input(struct worker *wk)
+{
+	struct iovec iov;
+	ssize_t ret;
+
+	for (;;) {
+		if (wk->stage == RECV_ROWS) {
+			ret = recv_ready(wk->fd, wk->iov + wk->row, wk->nrows - wk->row);
+			if (ret <= 0)
+				return ret;
+			wk->row += iov_advance(wk->iov + wk->row,
+				wk->nrows - wk->row, ret);
+			if (wk->row == wk->nrows)
+				worker_tile_done(wk);
+			continue;
+		}
+
+		iov.iov_base = wk->msg + wk->got;
+		iov.iov_len = wk->want - wk->got;
+		ret = recv_ready(wk->fd, &iov, 1);
+		if (ret <= 0)
+			return ret;
+		if ((wk->got += ret) < wk->want)
+			continue;
+		if ((wk->stage == RECV_HELLO ? worker_hello(wk) : worker_result(wk)) < 0)
+			return -1;
+	}
+}
+
+/* Keep every worker busy with up to DIST_INFLIGHT tiles */
+void issue_tiles(void)
+{
+	struct dist_tile dt;
+	struct worker *wk;
+	int w, id;
+
+	for (w = 0; w < nworkers; w++) {
+		wk = &workers[w];
+		if (wk->stage == RECV_HELLO)
+			continue;
+		while (wk->ninflight < DIST_INFLIGHT && (id = pending_tile()) >= 0) {
+			dt.id = id;
+			dt.x = tiles[id].x;
+			dt.y = tiles[id].y;
+			dt.w = tiles[id].w;
+			dt.h = tiles[id].h;
+			if (wk->ninflight == 0)
+				wk->since = now_sec();
+			wk->inflight[wk->ninflight++] = id;
+			tiles[id].state = TILE_ISSUED;
+			/*
+			 * No more than DIST_INFLIGHT small TILEs are ever unanswered,
+			 * so they fit in the socket's buffer, and never block.
+			 */
+			if (send_msg(wk->fd, MSG_TILE, &dt, sizeof(dt)) < 0) {
+				worker_lost(w--, "send failed");
+				break;
+			}
+		}
+	}
+}
+
+void coordinator(int lfd)
+{
+	struct pollfd pfd[DIST_MAX_WORKERS + 1];
+	double idle = now_sec(), t;
+	int w, n, greeted;
+
+	/* New connections are picked up after poll(), and must not block */
+	if (fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK) < 0) {
+		perror("fcntl");
+		exit(1);
+	}
+
+	while (tiles_done < ntiles) {
+		issue_tiles();
+
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		for (w = 0; w < nworkers; w++) {
+			pfd[w + 1].fd = workers[w].fd;
+			pfd[w + 1].events = POLLIN;
+		}
+		n = nworkers;
+		if (poll(pfd, n + 1, 1000) < 0 && errno != EINTR) {
+			perror("poll");
+			exit(1);
+		}
+
+		/* Go backwards, lost workers are replaced by the last one */
+		t = now_sec();
+		greeted = 0;
+		for (w = n - 1; w >= 0; w--) {
+			if (pfd[w + 1].revents && worker_input(&workers[w]) < 0)
+				worker_lost(w, "connection closed or bad message");
+			else if ((workers[w].stage == RECV_HELLO || workers[w].ninflight > 0) &&
+			    t - workers[w].since > timeout)
+				worker_lost(w, "timed out");
+			else if (workers[w].stage != RECV_HELLO)
+				greeted++;
+		}
+
+		if (pfd[0].revents & POLLIN)
+			worker_accept(lfd);
+
+		/* Connections that never said HELLO do not count */
+		if (greeted > 0) {
+			idle = now_sec();
+		} else if (now_sec() - idle > timeout) {
+			fprintf(stderr, "No workers for %.0f s, giving up with %d of %d "
+				"tiles done\n", timeout, tiles_done, ntiles);
+			exit(1);
+		}
+	}
+}
+
+void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s -o image.ppm|image.pgm -l ADDRESS [-w local_workers]\n"
+		"          [-g WIDTHxHEIGHT] [-C X,Y] [-z zoom] [-i iterations]\n"
+		"          [-T tile_size] [-t timeout] [-D tiles]\n"
+		"       %s -W ADDRESS [-D tiles]\n\n"
+		"    ADDRESS is host:port for TCP, or the path of a UNIX-domain socket.\n"
+		"    -l: Coordinate: listen on ADDRESS for workers, and write the image.\n"
+		"    -W: Work for the coordinator at ADDRESS.\n"
+		"    -w: Also fork this many workers on this host (default: 0).\n"
+		"    -g: Size of the image, in pixels (default: %dx%d).\n"
+		"    -z: Magnification, zoom 1 shows the whole set (default: 1).\n"
+		"    -i: Maximum number of iterations per point (default: %d).\n"
+		"    -T: Tiles are this many pixels wide and high (default: %d).\n"
+		"    -t: Drop workers that stay silent for this many seconds with\n"
+		"        tiles to compute, or without saying hello, and give up\n"
+		"        without any (default: %.0f).\n"
+		"    -D: Exit after this many tiles, in the middle of sending one,\n"
+		"        to test re-issuing; applies to the first local worker.\n",
+		argv0, argv0, x_chars, y_chars, MANDEL_MAX_ITERATION,
+		tile_size, timeout);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, opt, status, lfd;
+	char *listen_addr = NULL, *work_addr = NULL;
+	double half_w, half_h, t0, elapsed;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "o:l:W:w:g:C:z:i:T:t:D:")) != -1) {
+		switch (opt) {
+		case 'o':
+			image_file = optarg;
+			break;
+		case 'l':
+			listen_addr = optarg;
+			break;
+		case 'W':
+			work_addr = optarg;
+			break;
+		case 'w':
+			local_workers = atoi(optarg);
+			if (local_workers < 0)
+				usage(argv[0]);
+			break;
+		case 'g':
+			if (sscanf(optarg, "%dx%d", &x_chars, &y_chars) != 2 ||
+			    x_chars <= 0 || y_chars <= 0)
+				usage(argv[0]);
+			break;
+		case 'C':
+			if (sscanf(optarg, "%lf,%lf", &center_x, &center_y) != 2)
+				usage(argv[0]);
+			break;
+		case 'z':
+			zoom = atof(optarg);
+			if (zoom <= 0)
+				usage(argv[0]);
+			break;
+		case 'i':
+			max_iteration = atoi(optarg);
+			if (max_iteration <= 0)
+				usage(argv[0]);
+			break;
+		case 'T':
+			tile_size = atoi(optarg);
+			if (tile_size <= 0 || tile_size > DIST_MAX_TILE)
+				usage(argv[0]);
+			break;
+		case 't':
+			timeout = atof(optarg);
+			if (timeout <= 0)
+				usage(argv[0]);
+			break;
+		case 'D':
+			die_after = atoi(optarg);
+			if (die_after < 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc != optind || !!listen_addr == !!work_addr)
+		usage(argv[0]);
+
+	if (work_addr)
+		worker(work_addr, die_after);
+
+	if (!image_file)
+		usage(argv[0]);
+
+	half_h = 1.0 / zoom;
+	half_w = half_h * x_chars / y_chars;
+	view.xmin = center_x - half_w;
+	view.ymax = center_y + half_h;
+	view.xstep = 2 * half_w / x_chars;
+	view.ystep = 2 * half_h / y_chars;
+	view.max_iter = max_iteration;
+
+	lfd = dist_socket(listen_addr, 1);
+	for (i = 0; i < local_workers; i++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			exit(1);
+		}
+		if (pid == 0) {
+			close(lfd);
+			worker(listen_addr, i == 0 ? die_after : -1);
+		}
+	}
+
+	image_open(image_file);
+	make_tiles();
+
+	t0 = now_sec();
+	coordinator(lfd);
+	elapsed = now_sec() - t0;
+
+	/* Closing the connections tells the workers we are done */
+	for (i = 0; i < nworkers; i++)
+		close(workers[i].fd);
+	close(lfd);
+	if (strchr(listen_addr, ':') == NULL)
+		unlink(listen_addr);
+	for (i = 0; i < local_workers; i++) {
+		pid = wait(&status);
+		if (pid < 0) {
+			perror("wait");
+			exit(1);
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			explain_wait_status(pid, status);
+	}
+
+	if (munmap(image_map, image_len) < 0) {
+		perror("munmap");
+		exit(1);
+	}
+
+	fprintf(stderr, "Rendered %dx%d pixels to %s in %.3f s, %.2f Mpixels/s\n",
+		x_chars, y_chars, image_file, elapsed,
+		(double)x_chars * y_chars / elapsed / 1e6);
+	fprintf(stderr, "%d tiles, %ld re-issued; %ld workers, %ld lost\n",
+		ntiles, reissued, workers_seen, workers_lost);
+
+	return 0;
+}
@@ -0,0 +1,257 @@
+/*
+ * mandel-fork.c
+ *
+ * A program to draw the Mandelbrot Set on a 256-color xterm,
+ * using processes instead of threads.
+ *
+ * The parent forks N_PROCS workers, which share a frame buffer and
+ * a line counter with it, in an area created by
+ * create_shared_memory_area(). Workers grab lines from the counter
+ * and store their color values straight into the frame buffer.
+ * Once every worker has exited, the parent draws the frame.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "cpu-topology.h"
+#include "mandel-lib.h"
+#include "proc-common.h"
+
+#define MANDEL_MAX_ITERATION 100000
+
+/*
+ * The area shared by the parent and the workers
+ */
+struct shared_frame {
+	int next_line;          /* Next line to hand out, updated atomically */
+	unsigned char color_val[];  /* y_chars lines of x_chars color values */
+};
+
+int N_PROCS;
+int chunk = 1;
+int pin = 0;
+struct cpu_topology topo;       /* The CPUs workers are pinned to */
+int quiet = 0;
+int max_iteration = MANDEL_MAX_ITERATION;
+
+/*
+ * Output at the terminal is is x_chars wide by y_chars long
+*/
+int y_chars = 50;
+int x_chars = 90;
+
+/*
+ * The part of the complex plane to be drawn:
+ * upper left corner is (xmin, ymax), lower right corner is (xmax, ymin),
+ * set from the center and zoom as in mandel.c
+*/
+double center_x = -0.4, center_y = 0.0, zoom = 1.0;
+double xmin, xmax;
+double ymin, ymax;
+
+/*
+ * Every character in the final output is
+ * xstep x ystep units wide on the complex plane.
+ */
+double xstep;
+double ystep;
+
+double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * This function computes a line of output
+ * as an array of x_char color values.
+ */
+void compute_mandel_line(int line, unsigned char color_val[])
+{
+	int n, val;
+
+	for (n = 0; n < x_chars; n++) {
+		val = mandel_iterations_at_point(xmin + xstep * n,
+			ymax - ystep * line, max_iteration);
+		color_val[n] = (val > 255) ? 255 : val;
+	}
+}
+
+/*
+ * This function outputs an array of x_char color values
+ * to a 256-color xterm, with a single write.
+ */
+void output_mandel_line(int fd, unsigned char color_val[])
+{
+	int i, color;
+	static int current_color = -1;
+	char buf[x_chars * (XTERM_COLOR_MAXLEN + 1) + 1];
+	char *p = buf;
+
+	for (i = 0; i < x_chars; i++) {
+		color = xterm_color(color_val[i]);
+		if (color != current_color) {
+			p += format_xterm_color(p, color);
+			current_color = color;
+		}
+		*p++ = '@';
+	}
+	*p++ = '\n';
+
+	if (insist_write(fd, buf, p - buf) != p - buf) {
+		perror("output_mandel_line: write");
+		exit(1);
+	}
+}
+
+/*
+ * A worker process: compute tiles of 'chunk' lines,
+ * until there are none left.
+ */
+void worker(int id, struct shared_frame *sf)
+{
+	int tile, line;
+	cpu_set_t set;
+
+	if (pin) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu_topology_place(&topo, id, PLACE_COMPACT), &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+			perror("sched_setaffinity");
+			exit(1);
+		}
+	}
+
+	while ((tile = __sync_fetch_and_add(&sf->next_line, chunk)) < y_chars)
+		for (line = tile; line < tile + chunk && line < y_chars; line++)
+			compute_mandel_line(line, &sf->color_val[line * x_chars]);
+
+	exit(0);
+}
+
+void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-c chunk] [-g WIDTHxHEIGHT] [-C X,Y] [-z zoom]\n"
+		"          [-i iterations] [-p] [-q] <N_PROCS>\n\n"
+		"    -c: Number of consecutive lines handed out at a time (default: 1).\n"
+		"    -g: Size of the output, in characters (default: 90x50).\n"
+		"    -C: Center of the view on the complex plane (default: -0.4,0).\n"
+		"    -z: Magnification, zoom 1 shows the whole set (default: 1).\n"
+		"    -i: Maximum number of iterations per point (default: %d).\n"
+		"    -p: Pin worker i to the i-th of the CPUs we may run on,\n"
+		"        filling one NUMA node after the other.\n"
+		"    -q: Only compute the frame, do not draw it.\n",
+		argv0, MANDEL_MAX_ITERATION);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, opt, status;
+	pid_t pid;
+	struct shared_frame *sf;
+	double t0, elapsed;
+
+	while ((opt = getopt(argc, argv, "c:g:C:z:i:pq")) != -1) {
+		switch (opt) {
+		case 'c':
+			chunk = atoi(optarg);
+			if (chunk <= 0)
+				usage(argv[0]);
+			break;
+		case 'g':
+			if (sscanf(optarg, "%dx%d", &x_chars, &y_chars) != 2 ||
+			    x_chars <= 0 || y_chars <= 0)
+				usage(argv[0]);
+			break;
+		case 'C':
+			if (sscanf(optarg, "%lf,%lf", &center_x, &center_y) != 2)
+				usage(argv[0]);
+			break;
+		case 'z':
+			zoom = atof(optarg);
+			if (zoom <= 0)
+				usage(argv[0]);
+			break;
+		case 'i':
+			max_iteration = atoi(optarg);
+			if (max_iteration <= 0)
+				usage(argv[0]);
+			break;
+		case 'p':
+			pin = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1)
+		usage(argv[0]);
+	N_PROCS = atoi(argv[optind]);
+	if (N_PROCS <= 0)
+		usage(argv[0]);
+
+	xmin = center_x - 1.4 / zoom;
+	xmax = center_x + 1.4 / zoom;
+	ymin = center_y - 1.0 / zoom;
+	ymax = center_y + 1.0 / zoom;
+	xstep = (xmax - xmin) / x_chars;
+	ystep = (ymax - ymin) / y_chars;
+
+	sf = create_shared_memory_area(sizeof(*sf) + (size_t)x_chars * y_chars);
+	sf->next_line = 0;
+	if (pin)
+		cpu_topology_init(&topo);
+
+	t0 = now_sec();
+	for (i = 0; i < N_PROCS; i++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			exit(1);
+		}
+		if (pid == 0)
+			worker(i, sf);
+	}
+
+	/* Wait for all workers: the frame is complete only after the last one */
+	for (i = 0; i < N_PROCS; i++) {
+		pid = wait(&status);
+		if (pid < 0) {
+			perror("wait");
+			exit(1);
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			explain_wait_status(pid, status);
+			exit(1);
+		}
+	}
+	elapsed = now_sec() - t0;
+
+	if (!quiet) {
+		for (i = 0; i < y_chars; i++)
+			output_mandel_line(1, &sf->color_val[i * x_chars]);
+		reset_xterm_color(1);
+	}
+
+	fprintf(stderr, "Computed %dx%d points with %d processes in %.6f s, %.2f Mpixels/s\n",
+		x_chars, y_chars, N_PROCS, elapsed,
+		(double)x_chars * y_chars / elapsed / 1e6);
+
+	return 0;
+}
@@ -9,10 +9,39 @@
 #ifndef MANDEL_LIB_H__
 #define MANDEL_LIB_H__
 
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Longest control sequence stored by format_xterm_color() */
+#define XTERM_COLOR_MAXLEN 11
+
+/*
+ * Fixed-point coordinates have MANDEL_FIXED_SHIFT fractional bits,
+ * so they range over +-MANDEL_FIXED_MAX, in steps of 2^-MANDEL_FIXED_SHIFT.
+ */
+#define MANDEL_FIXED_SHIFT 28
+#define MANDEL_FIXED_MAX 8.0
+
 /* Function prototypes */
 int mandel_iterations_at_point(double x, double y, int max);
+int mandel_iterations_at_point_float(float x, float y, int max);
+int mandel_iterations_at_point_fixed(int32_t x, int32_t y, int max);
+int32_t mandel_to_fixed(double v);
+void mandel_iterations_row(double x0, double xstep, double y, int n,
+	int max, int *iter);
+void mandel_iterations_row_float(double x0, double xstep, double y, int n,
+	int max, int *iter);
+void mandel_iterations_row_fixed(double x0, double xstep, double y, int n,
+	int max, int *iter);
+float mandel_smooth_at_point(double x, double y, int max);
+void mandel_smooth_row(double x0, double xstep, double y, int n,
+	int max, float *v);
 unsigned char xterm_color(int color_val);
+unsigned char xterm_color_search(int color_val);
+void mandel_rgb(int color_val, unsigned char *rgb);
+void mandel_rgb_row(const float *v, int n, unsigned char *rgb);
 ssize_t insist_write(int fd, const char *buf, size_t count);
+int format_xterm_color(char *buf, unsigned char color);
 void set_xterm_color(int fd, unsigned char color);
 void reset_xterm_color(int fd);
 
@@ -1,34 +1,190 @@
 /*
  * mandel.c
  *
- * A program to draw the Mandelbrot Set on a 256-color xterm.
+ * A program to draw the Mandelbrot Set on a 256-color xterm,
+ * or to render it into a PPM/PGM image file of any size.
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include <stdlib.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include "mandel-lib.h"
+#include "mandel-deep.h"
+#include "mandel-cache.h"
+#include "cpu-topology.h"
 
 #define MANDEL_MAX_ITERATION 100000
 
-// Declare a pointer for semaphore in global context
-sem_t* semaphore;
+#define perror_pthread(ret, msg) \
+	do { errno = ret; perror(msg); } while (0)
+
 int N_THREADS;
+int max_iteration = MANDEL_MAX_ITERATION;
+
+/*
+ * How lines are distributed among threads:
+ * SCHED_STATIC gives thread i lines i, i + N_THREADS, i + 2*N_THREADS, etc,
+ * SCHED_DYNAMIC has threads grab the next tile of 'chunk' lines
+ * from a shared counter, as soon as they are done with their previous one.
+ */
+enum { SCHED_STATIC, SCHED_DYNAMIC };
+int sched = SCHED_DYNAMIC;
+int chunk = 0;
+int next_line = 0;
+
+/*
+ * Successive refinement (Mariani-Silver rectangle checking).
+ * Regions of equal color value have no holes, so if all points on
+ * the border of a rectangle have the same color value, so do all points
+ * inside it. With 'refine' set, every tile of lines is drawn by checking
+ * the border of a rectangle and either filling it, or splitting it in
+ * four and checking each quarter in turn.
+ */
+int refine = 0;
+#define REFINE_MIN_SIZE 4       /* Smaller rectangles are computed point by point */
+#define REFINE_DEFAULT_CHUNK 32
+
+/*
+ * Tile cache, see mandel-cache.h.
+ * With a cache, views are snapped to the nearest zoom level of the
+ * cache's grid, and every point (n, line) of the output is grid point
+ * (grid_x0 + n, grid_y0 + line), so tiles computed for one view can be
+ * reused by any other view at the same level. Points are square then,
+ * on the terminal too.
+ */
+struct tile_cache cache;
+int use_cache = 0;
+int cache_tiles = 1024;
+char *cache_file = NULL;
+#define CACHE_DISK_SLOTS_PER_TILE 4
+int grid_level;
+int64_t grid_x0, grid_y0;
+
+/*
+ * How points are computed:
+ * KERNEL_DOUBLE iterates every point in double precision,
+ * KERNEL_FLOAT in single precision, KERNEL_FIXED in 32-bit fixed point,
+ * KERNEL_DEEP iterates them as perturbations of a reference orbit
+ * through the center of the view, see mandel-deep.h.
+ * KERNEL_AUTO picks one of them for every frame, see pick_kernel().
+ */
+enum { KERNEL_DOUBLE, KERNEL_FLOAT, KERNEL_FIXED, KERNEL_DEEP, KERNEL_AUTO };
+const char *kernel_name[] = { "double", "float", "fixed", "deep", "auto" };
+int kernel = KERNEL_DOUBLE;
+int frame_kernel;               /* The kernel of the current frame */
+int kernel_frames[KERNEL_AUTO]; /* Frames computed with each kernel */
+struct mandel_orbit orbit;
+int glitches = 0;
+
+/*
+ * Thread placement.
+ * With -p, worker i is pinned to CPU cpu_topology_place(i), from the
+ * moment it is created. Everything a worker allocates for itself (its
+ * stack, its tile buffer) is then first touched, and so placed,
+ * on its own node, and so are the pages of the image it writes.
+ */
+struct cpu_topology topo;
+int place = -1;                 /* PLACE_COMPACT, PLACE_SCATTER, or -1 */
+
+/* Print per-thread statistics at the end */
+int verbose = 0;
+
+/* Only compute frames, do not output them anywhere, for benchmarks */
+int quiet = 0;
+double total_elapsed = 0;
+
+/*
+ * Worker threads are created once and reused for every frame.
+ * The main thread sets up each frame, releases the workers through
+ * frame_start, then waits for all of them at frame_done.
+ */
+pthread_barrier_t frame_start, frame_done;
+int quit = 0;
+
+/*
+ * A (distinct) instance of this structure
+ * is passed to each thread
+ */
+struct thread_info_struct {
+	pthread_t tid;
+	int thrid;
+	int cpu;        /* CPU it is pinned to, or -1 */
+
+	int lines;      /* Number of lines computed by this thread */
+	long points;    /* Number of points actually computed for them */
+	double busy;    /* Seconds spent computing them */
+	double stall;   /* Seconds spent handing them to the output */
+
+	int *tile_val;  /* Color values of the tile being refined */
+
+	long *node_points;   /* Points computed on each node */
+	double *node_busy;   /* Seconds spent computing them */
+};
+
+/*
+ * Image output.
+ * If image_file is set, lines are not drawn on the terminal, but
+ * stored straight into a memory-mapped PPM (or PGM, if the file name
+ * ends in ".pgm") image. Lines need not be stored in order, so there
+ * is no writer thread, and the kernel writes finished pages back to the
+ * file on its own, so the image never has to fit in RAM.
+ */
+char *image_file = NULL;
+int image_gray;             /* 1 byte per pixel (PGM) instead of 3 (PPM) */
+unsigned char *image_map;   /* The whole file, header included */
+size_t image_len;
+unsigned char *image_pixels;
+
+/*
+ * With smooth set, image lines are computed as continuous escape times
+ * instead of iteration counts, and colored by interpolating between
+ * palette entries, so there are no bands. See mandel_smooth_row().
+ */
+int smooth = 0;
+
+/*
+ * Lines are computed out of order, but must be output in order.
+ * Workers deposit finished lines into a bounded ring of slots,
+ * line l always going to slot l % nslots, and a single writer thread
+ * outputs them as soon as the next line in order is available.
+ * Workers only wait if the slot for their line is still occupied,
+ * i.e. if they have run more than nslots lines ahead of the output.
+ */
+struct reorder_buffer {
+	pthread_mutex_t mutex;
+	pthread_cond_t slot_free;   /* Signalled when the writer outputs a line */
+	pthread_cond_t line_ready;  /* Signalled when a worker deposits a line */
+
+	int nslots;
+	int emitted;    /* Lines 0 .. emitted-1 have been output */
+	int *ready;     /* ready[s] is the line held in slot s, or -1 */
+	int *color_val; /* nslots lines of x_chars color values each */
+};
 
-/***************************
- * Compile-time parameters *
- ***************************/
+struct reorder_buffer rob;
+int rob_slots = 0;
+
+/**********************
+ * Drawing parameters *
+ **********************/
 
 /*
  * Output at the terminal is is x_chars wide by y_chars long
+ * (or, for images, x_chars by y_chars pixels, see -g)
 */
 int y_chars = 50;
 int x_chars = 90;
@@ -36,9 +192,27 @@ int x_chars = 90;
 /*
  * The part of the complex plane to be drawn:
  * upper left corner is (xmin, ymax), lower right corner is (xmax, ymin)
+ * It is set by set_viewport() for every frame.
 */
-double xmin = -1.8, xmax = 1.0;
-double ymin = -1.0, ymax = 1.0;
+double xmin, xmax;
+double ymin, ymax;
+
+/*
+ * The view is centered at (center_x, center_y). At zoom 1 it is
+ * 2.0 units high and, on the terminal, 2.8 units wide: -1.8 .. 1.0.
+ * Images keep their pixels square instead.
+ * A zoom sequence moves the center and zoom from these values to
+ * the end_* ones, geometrically for zoom, over 'frames' frames.
+ * Centers are kept in double-double precision, for deep zooms.
+ */
+dd_t center_x = { -0.4, 0.0 }, center_y = { 0.0, 0.0 };
+dd_t end_x, end_y;
+double zoom = 1.0, end_zoom;
+int frames = 1;
+
+/* The current view, for the deep kernel: its center and half-size */
+dd_t view_cx, view_cy;
+double view_half_w, view_half_h;
 
 /*
  * Every character in the final output is
@@ -48,59 +222,107 @@ double xstep;
 double ystep;
 
 /*
- * This function computes a line of output
- * as an array of x_char color values.
+ * This function computes the color value of the point
+ * at column n of line 'line', with the current kernel.
  */
-void compute_mandel_line(int line, int color_val[])
+int compute_mandel_point(int n, int line, int *glitches)
 {
-	/*
-	 * x and y traverse the complex plane.
-	 */
-	double x, y;
-
-	int n;
 	int val;
 
-	/* Find out the y value corresponding to this line */
-	y = ymax - ystep * line;
+	switch (frame_kernel) {
+	case KERNEL_DEEP:
+		/* Offsets from the center, the reference point */
+		val = mandel_perturb_iterations(&orbit,
+			2 * view_half_w / x_chars * n - view_half_w,
+			view_half_h - 2 * view_half_h / y_chars * line,
+			max_iteration, glitches);
+		break;
+	case KERNEL_FLOAT:
+		val = mandel_iterations_at_point_float(xmin + xstep * n,
+			ymax - ystep * line, max_iteration);
+		break;
+	case KERNEL_FIXED:
+		val = mandel_iterations_at_point_fixed(
+			mandel_to_fixed(xmin + xstep * n),
+			mandel_to_fixed(ymax - ystep * line), max_iteration);
+		break;
+	default:
+		val = mandel_iterations_at_point(xmin + xstep * n,
+			ymax - ystep * line, max_iteration);
+	}
 
-	/* and iterate for all points on this line */
-	for (x = xmin, n = 0; n < x_chars; x+= xstep, n++) {
+	return (val > 255) ? 255 : val;
+}
 
-		/* Compute the point's color value */
-		val = mandel_iterations_at_point(x, y, MANDEL_MAX_ITERATION);
-		if (val > 255)
-			val = 255;
+/*
+ * This function computes a line of output
+ * as an array of x_char color values,
+ * using a row kernel where there is one.
+ */
+void compute_mandel_line(int line, int color_val[])
+{
+	int n;
+	int line_glitches = 0;
 
-		/* And store it in the color_val[] array */
-		val = xterm_color(val);
-		color_val[n] = val;
+	switch (frame_kernel) {
+	case KERNEL_DOUBLE:
+		mandel_iterations_row(xmin, xstep, ymax - ystep * line,
+			x_chars, max_iteration, color_val);
+		break;
+	case KERNEL_FLOAT:
+		mandel_iterations_row_float(xmin, xstep, ymax - ystep * line,
+			x_chars, max_iteration, color_val);
+		break;
+	case KERNEL_FIXED:
+		mandel_iterations_row_fixed(xmin, xstep, ymax - ystep * line,
+			x_chars, max_iteration, color_val);
+		break;
+	default:
+		for (n = 0; n < x_chars; n++)
+			color_val[n] = compute_mandel_point(n, line, &line_glitches);
 	}
+	for (n = 0; n < x_chars; n++)
+		if (color_val[n] > 255)
+			color_val[n] = 255;
+
+	if (line_glitches)
+		__sync_fetch_and_add(&glitches, line_glitches);
 }
 
 /*
  * This function outputs an array of x_char color values
  * to a 256-color xterm.
+ *
+ * The whole line is formatted into a single buffer and output with
+ * a single write. The xterm keeps its current color between points
+ * and lines, so a control sequence is only emitted when the color
+ * actually changes.
  */
+int current_color = -1;
+
 void output_mandel_line(int fd, int color_val[])
 {
 	int i;
+	char buf[x_chars * (XTERM_COLOR_MAXLEN + 1) + 1];
+	char *p = buf;
 
-	char point ='@';
-	char newline='\n';
+	int color;
 
 	for (i = 0; i < x_chars; i++) {
 		/* Set the current color, then output the point */
-		set_xterm_color(fd, color_val[i]);
-		if (write(fd, &point, 1) != 1) {
-			perror("compute_and_output_mandel_line: write point");
-			exit(1);
+		color = xterm_color(color_val[i]);
+		if (color != current_color) {
+			p += format_xterm_color(p, color);
+			current_color = color;
 		}
+		*p++ = '@';
 	}
 
 	/* Now that the line is done, output a newline character */
-	if (write(fd, &newline, 1) != 1) {
-		perror("compute_and_output_mandel_line: write newline");
+	*p++ = '\n';
+
+	if (insist_write(fd, buf, p - buf) != p - buf) {
+		perror("output_mandel_line: write");
 		exit(1);
 	}
 }
@@ -118,33 +340,689 @@ void *safe_malloc(size_t size)
 	return p;
 }
 
-void compute_and_output_mandel_line(int fd, int line)
+double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Make the buffer ready for a new frame */
+void rob_reset(struct reorder_buffer *rb)
+{
+	int s;
+
+	rb->emitted = 0;
+	for (s = 0; s < rb->nslots; s++)
+		rb->ready[s] = -1;
+}
+
+void rob_init(struct reorder_buffer *rb, int nslots)
+{
+	pthread_mutex_init(&rb->mutex, NULL);
+	pthread_cond_init(&rb->slot_free, NULL);
+	pthread_cond_init(&rb->line_ready, NULL);
+
+	rb->nslots = nslots;
+	rb->ready = safe_malloc(nslots * sizeof(*rb->ready));
+	rb->color_val = safe_malloc(nslots * x_chars * sizeof(*rb->color_val));
+	rob_reset(rb);
+}
+
+/* Deposit a computed line, waiting only if its slot is still occupied */
+void rob_put(struct reorder_buffer *rb, int line, int color_val[])
+{
+	int s = line % rb->nslots;
+
+	pthread_mutex_lock(&rb->mutex);
+	while (line >= rb->emitted + rb->nslots)
+		pthread_cond_wait(&rb->slot_free, &rb->mutex);
+	memcpy(&rb->color_val[s * x_chars], color_val, x_chars * sizeof(*color_val));
+	rb->ready[s] = line;
+	if (line == rb->emitted)
+		pthread_cond_signal(&rb->line_ready);
+	pthread_mutex_unlock(&rb->mutex);
+}
+
+/*
+ * Output all lines of a frame, in order.
+ * The main thread does this while the workers compute the frame.
+ */
+void write_frame(struct reorder_buffer *rb)
+{
+	int line, s;
+
+	for (line = 0; line < y_chars; line++) {
+		s = line % rb->nslots;
+
+		pthread_mutex_lock(&rb->mutex);
+		while (rb->ready[s] != line)
+			pthread_cond_wait(&rb->line_ready, &rb->mutex);
+		pthread_mutex_unlock(&rb->mutex);
+
+		/* No worker touches the slot until we mark it free */
+		output_mandel_line(1, &rb->color_val[s * x_chars]);
+
+		pthread_mutex_lock(&rb->mutex);
+		rb->ready[s] = -1;
+		rb->emitted++;
+		pthread_cond_broadcast(&rb->slot_free);
+		pthread_mutex_unlock(&rb->mutex);
+	}
+}
+
+/*
+ * Create the image file, big enough for x_chars by y_chars pixels,
+ * and map it into memory.
+ */
+void image_open(char *file)
+{
+	int fd, hlen;
+	char header[64];
+	size_t len = strlen(file);
+
+	image_gray = (len >= 4 && strcmp(file + len - 4, ".pgm") == 0);
+	hlen = snprintf(header, sizeof(header), "P%d\n%d %d\n255\n",
+		image_gray ? 5 : 6, x_chars, y_chars);
+	image_len = hlen + (size_t)x_chars * y_chars * (image_gray ? 1 : 3);
+
+	fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(file);
+		exit(1);
+	}
+	if (ftruncate(fd, image_len) < 0) {
+		perror("image_open: ftruncate");
+		exit(1);
+	}
+	image_map = mmap(NULL, image_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (image_map == MAP_FAILED) {
+		perror("image_open: mmap");
+		exit(1);
+	}
+	close(fd);
+
+	memcpy(image_map, header, hlen);
+	image_pixels = image_map + hlen;
+}
+
+/*
+ * Unmap the pages a stored line completely covers. They stay dirty
+ * in the page cache until the kernel writes them back, but no longer
+ * count against our memory.
+ */
+void image_release_line(int line)
+{
+	long pagesize = sysconf(_SC_PAGE_SIZE);
+	size_t bpp = image_gray ? 1 : 3;
+	uintptr_t p = (uintptr_t)image_pixels + (size_t)line * x_chars * bpp;
+	uintptr_t start, end;
+
+	start = (p + pagesize - 1) & ~(pagesize - 1);
+	end = (p + x_chars * bpp) & ~(pagesize - 1);
+	if (end > start)
+		madvise((void *)start, end - start, MADV_DONTNEED);
+}
+
+/* Store a line of color values into the image */
+void image_store_line(int line, int color_val[])
+{
+	int i;
+	size_t bpp = image_gray ? 1 : 3;
+	unsigned char *p = image_pixels + (size_t)line * x_chars * bpp;
+
+	for (i = 0; i < x_chars; i++, p += bpp) {
+		if (image_gray)
+			*p = color_val[i];
+		else
+			mandel_rgb(color_val[i], p);
+	}
+	image_release_line(line);
+}
+
+/* Store a line of continuous values, in [0, 1], into the image */
+void image_store_smooth_line(int line, float val[])
+{
+	int i;
+	unsigned char *p = image_pixels + (size_t)line * x_chars * (image_gray ? 1 : 3);
+
+	if (image_gray)
+		for (i = 0; i < x_chars; i++)
+			p[i] = val[i] * 255 + 0.5f;
+	else
+		mandel_rgb_row(val, x_chars, p);
+	image_release_line(line);
+}
+
+void image_close(void)
+{
+	if (munmap(image_map, image_len) < 0) {
+		perror("image_close: munmap");
+		exit(1);
+	}
+}
+
+/* Hand a computed line to the output, if any */
+void output_line(int line, int color_val[])
+{
+	if (image_file)
+		image_store_line(line, color_val);
+	else if (!quiet)
+		rob_put(&rob, line, color_val);
+}
+
+void compute_and_output_mandel_line(int line, struct thread_info_struct *thr)
 {
 	/*
 	 * A temporary array, used to hold color values for the line being drawn
 	 */
 	int color_val[x_chars];
+	float smooth_val[x_chars];
+	double t0, t1;
+
+	t0 = now_sec();
+	if (smooth) {
+		mandel_smooth_row(xmin, xstep, ymax - ystep * line, x_chars,
+			max_iteration, smooth_val);
+		t1 = now_sec();
+		image_store_smooth_line(line, smooth_val);
+	} else {
+		compute_mandel_line(line, color_val);
+		t1 = now_sec();
+		output_line(line, color_val);
+	}
 
-	compute_mandel_line(line, color_val);
-    // Wait for the corresponding sempahore, then output line
-    sem_wait(&semaphore[line % N_THREADS]);
-	output_mandel_line(fd, color_val);
-    // Increase sempahore of next line
-    sem_post(&semaphore[(line + 1) % N_THREADS]);
+	thr->busy += t1 - t0;
+	thr->stall += now_sec() - t1;
+	thr->lines++;
+	thr->points += x_chars;
 }
 
+/* A tile of lines top .. top + h - 1, being refined */
+struct refine_tile {
+	int top, h;
+	int *val;       /* h lines of x_chars color values, -1 if not computed yet */
+	long points;
+	int glitches;
+};
 
+int refine_point(struct refine_tile *t, int n, int y)
+{
+	int *v = &t->val[y * x_chars + n];
+
+	if (*v < 0) {
+		*v = compute_mandel_point(n, t->top + y, &t->glitches);
+		t->points++;
+	}
+	return *v;
+}
+
+/* Fill in the rectangle with corners (x0, y0), (x1, y1), inclusive */
+void refine_rect(struct refine_tile *t, int x0, int y0, int x1, int y1)
+{
+	int n, y, val, same, xm, ym;
+
+	if (x1 - x0 < REFINE_MIN_SIZE || y1 - y0 < REFINE_MIN_SIZE) {
+		for (y = y0; y <= y1; y++)
+			for (n = x0; n <= x1; n++)
+				refine_point(t, n, y);
+		return;
+	}
+
+	/* Check the border. All of it is needed by the quarters anyway. */
+	val = refine_point(t, x0, y0);
+	same = 1;
+	for (n = x0; n <= x1; n++) {
+		same &= (refine_point(t, n, y0) == val);
+		same &= (refine_point(t, n, y1) == val);
+	}
+	for (y = y0 + 1; y < y1; y++) {
+		same &= (refine_point(t, x0, y) == val);
+		same &= (refine_point(t, x1, y) == val);
+	}
+
+	if (same) {
+		for (y = y0 + 1; y < y1; y++)
+			for (n = x0 + 1; n < x1; n++)
+				t->val[y * x_chars + n] = val;
+		return;
+	}
+
+	/* The quarters share their inner borders, which are computed once */
+	xm = (x0 + x1) / 2;
+	ym = (y0 + y1) / 2;
+	refine_rect(t, x0, y0, xm, ym);
+	refine_rect(t, xm, y0, x1, ym);
+	refine_rect(t, x0, ym, xm, y1);
+	refine_rect(t, xm, ym, x1, y1);
+}
+
+/* Compute a whole tile of lines by successive refinement, then output it */
+void compute_and_output_mandel_tile(int tile, struct thread_info_struct *thr)
+{
+	struct refine_tile t;
+	double t0, t1;
+	int i;
+
+	if (thr->tile_val == NULL)
+		thr->tile_val = safe_malloc(chunk * x_chars * sizeof(*thr->tile_val));
+
+	t.top = tile;
+	t.h = (tile + chunk <= y_chars) ? chunk : y_chars - tile;
+	t.val = thr->tile_val;
+	t.points = 0;
+	t.glitches = 0;
+	for (i = 0; i < t.h * x_chars; i++)
+		t.val[i] = -1;
+
+	t0 = now_sec();
+	refine_rect(&t, 0, 0, x_chars - 1, t.h - 1);
+	if (t.glitches)
+		__sync_fetch_and_add(&glitches, t.glitches);
+	t1 = now_sec();
+
+	for (i = 0; i < t.h; i++)
+		output_line(tile + i, &t.val[i * x_chars]);
+
+	thr->busy += t1 - t0;
+	thr->stall += now_sec() - t1;
+	thr->lines += t.h;
+	thr->points += t.points;
+}
+
+/* Floor of a / TILE_SIZE, for negative a too */
+int64_t tile_of(int64_t a)
+{
+	return (a >= 0) ? a / TILE_SIZE : -((-a + TILE_SIZE - 1) / TILE_SIZE);
+}
+
+/* Compute a tile missing from the cache, on behalf of thread arg */
+void fill_tile(const struct tile_key *key, uint16_t *iter, void *arg)
+{
+	struct thread_info_struct *thr = arg;
+	double step = ldexp(TILE_BASE_STEP, -key->level);
+	int i, j, val;
+
+	for (j = 0; j < TILE_SIZE; j++)
+		for (i = 0; i < TILE_SIZE; i++) {
+			val = mandel_iterations_at_point(
+				(key->tx * TILE_SIZE + i) * step,
+				-(key->ty * TILE_SIZE + j) * step, key->max_iter);
+			iter[j * TILE_SIZE + i] = (val > UINT16_MAX) ? UINT16_MAX : val;
+		}
+
+	thr->points += TILE_SIZE * TILE_SIZE;
+}
+
+/*
+ * Assemble a tile of lines from cache tiles, computing the missing ones,
+ * then output it.
+ */
+void compute_and_output_cached_lines(int tile, struct thread_info_struct *thr)
+{
+	int h, n, y, i, i0, i1, j0, j1, val;
+	int64_t tx, ty;
+	struct tile_key key;
+	const uint16_t *iter;
+	double t0, t1;
+
+	if (thr->tile_val == NULL)
+		thr->tile_val = safe_malloc(chunk * x_chars * sizeof(*thr->tile_val));
+	h = (tile + chunk <= y_chars) ? chunk : y_chars - tile;
+
+	t0 = now_sec();
+	key.level = grid_level;
+	key.max_iter = max_iteration;
+	for (ty = tile_of(grid_y0 + tile); ty <= tile_of(grid_y0 + tile + h - 1); ty++) {
+		/* The lines of this tile row, relative to the tile */
+		j0 = grid_y0 + tile - ty * TILE_SIZE;
+		j1 = j0 + h;
+		if (j0 < 0)
+			j0 = 0;
+		if (j1 > TILE_SIZE)
+			j1 = TILE_SIZE;
+
+		for (tx = tile_of(grid_x0); tx <= tile_of(grid_x0 + x_chars - 1); tx++) {
+			i0 = grid_x0 - tx * TILE_SIZE;
+			i1 = i0 + x_chars;
+			if (i0 < 0)
+				i0 = 0;
+			if (i1 > TILE_SIZE)
+				i1 = TILE_SIZE;
+
+			key.tx = tx;
+			key.ty = ty;
+			iter = tile_cache_get(&cache, &key, fill_tile, thr);
+			for (y = j0; y < j1; y++)
+				for (i = i0; i < i1; i++) {
+					val = iter[y * TILE_SIZE + i];
+					n = tx * TILE_SIZE + i - grid_x0;
+					thr->tile_val[(ty * TILE_SIZE + y - grid_y0 - tile) * x_chars + n] =
+						(val > 255) ? 255 : val;
+				}
+			tile_cache_release(&cache, iter);
+		}
+	}
+	t1 = now_sec();
+
+	for (i = 0; i < h; i++)
+		output_line(tile + i, &thr->tile_val[i * x_chars]);
+
+	thr->busy += t1 - t0;
+	thr->stall += now_sec() - t1;
+	thr->lines += h;
+}
+
+/*
+ * Return the first line of the next tile to be computed
+ * by thread thr, or y_chars if there is nothing left.
+ * Static tiles are 'chunk' lines long too.
+ */
+int next_tile(struct thread_info_struct *thr, int prev)
+{
+	if (sched == SCHED_STATIC)
+		return (prev < 0) ? thr->thrid * chunk : prev + N_THREADS * chunk;
+
+	return __sync_fetch_and_add(&next_line, chunk);
+}
+
+void *thread_function(void *arg) {
+	struct thread_info_struct *thr = arg;
+	int tile, line, node;
+	long points;
+	double busy;
+
+	for (;;) {
+		pthread_barrier_wait(&frame_start);
+		if (quit)
+			break;
+
+		points = thr->points;
+		busy = thr->busy;
+
+		for (tile = next_tile(thr, -1); tile < y_chars; tile = next_tile(thr, tile)) {
+			if (use_cache) {
+				compute_and_output_cached_lines(tile, thr);
+				continue;
+			}
+			if (refine) {
+				compute_and_output_mandel_tile(tile, thr);
+				continue;
+			}
+			for (line = tile; line < tile + chunk && line < y_chars; line++)
+				compute_and_output_mandel_line(line, thr);
+		}
+
+		/* Unpinned threads may migrate, count the frame where it ended */
+		node = cpu_topology_node(&topo, thr->cpu >= 0 ? thr->cpu : sched_getcpu());
+		thr->node_points[node] += thr->points - points;
+		thr->node_busy[node] += thr->busy - busy;
+
+		pthread_barrier_wait(&frame_done);
+	}
 
-void *thread_function(void* line_arg) {
-    int* line_ptr = (int*)line_arg;
-    // Compute and  lines line, line  + N_THREADS, line + 2*NTHREADS, etc
-    int line;
-    for (line = *line_ptr; line < y_chars; line += N_THREADS) {
-        compute_and_output_mandel_line(1, line);
-    }
     pthread_exit(0);
 }
 
+/*
+ * Pick the cheapest kernel that is still accurate for the current view.
+ * A kernel is accurate while neighbouring points are at least
+ * PRECISION_ULPS units in the last place apart, at the largest
+ * magnitude the iteration goes through: the view's corners, or 2,
+ * beyond which points escape.
+ *
+ * From cheapest to dearest, per point: float, with twice the SIMD lanes
+ * of double, then double, then deep. Fixed point has more bits than
+ * float near the set, but without SIMD it costs more than double,
+ * so it is never picked.
+ */
+#define PRECISION_ULPS 1024
+
+int pick_kernel(void)
+{
+	double mag, step;
+
+	mag = fmax(fmax(fabs(xmin), fabs(xmax)), fmax(fabs(ymin), fabs(ymax)));
+	mag = fmax(mag, 2.0);
+	step = fmin(xstep, ystep);
+
+	if (step >= PRECISION_ULPS * ldexp(1.0, ilogb(mag) - (FLT_MANT_DIG - 1)))
+		return KERNEL_FLOAT;
+	if (step >= PRECISION_ULPS * ldexp(1.0, ilogb(mag) - (DBL_MANT_DIG - 1)))
+		return KERNEL_DOUBLE;
+	return KERNEL_DEEP;
+}
+
+/*
+ * Set up the part of the complex plane to be drawn, the kernel
+ * to draw it with, and the reference orbit through its center
+ * for the deep kernel.
+ */
+void set_viewport(dd_t cx, dd_t cy, double z)
+{
+	double half_h = 1.0 / z;
+	double half_w = half_h * (image_file ? (double)x_chars / y_chars : 1.4);
+
+	xmin = cx.hi - half_w;
+	xmax = cx.hi + half_w;
+	ymin = cy.hi - half_h;
+	ymax = cy.hi + half_h;
+
+	xstep = (xmax - xmin) / x_chars;
+	ystep = (ymax - ymin) / y_chars;
+
+	view_cx = cx;
+	view_cy = cy;
+	view_half_w = half_w;
+	view_half_h = half_h;
+	frame_kernel = (kernel == KERNEL_AUTO) ? pick_kernel() : kernel;
+	kernel_frames[frame_kernel]++;
+	if (frame_kernel == KERNEL_DEEP)
+		mandel_orbit_compute(&orbit, cx, cy, max_iteration);
+
+	if (use_cache) {
+		grid_level = lround(log2(TILE_BASE_STEP / (2 * half_h / y_chars)));
+		if (grid_level < 0)
+			grid_level = 0;
+		xstep = ystep = ldexp(TILE_BASE_STEP, -grid_level);
+		grid_x0 = floor(cx.hi / xstep - x_chars / 2.0);
+		grid_y0 = floor(-cy.hi / ystep - y_chars / 2.0);
+		xmin = grid_x0 * xstep;
+		ymax = -grid_y0 * ystep;
+	}
+}
+
+/* Parse "X,Y" or "X,Y,ZOOM", keeping all digits of X and Y */
+int parse_point(char *s, dd_t *x, dd_t *y, double *z)
+{
+	char *p;
+
+	*x = dd_from_string(s, &p);
+	if (p == s || *p != ',')
+		return -1;
+	*y = dd_from_string(s = p + 1, &p);
+	if (p == s)
+		return -1;
+	if (z == NULL)
+		return (*p == '\0') ? 0 : -1;
+	if (*p != ',')
+		return -1;
+	*z = strtod(s = p + 1, &p);
+	return (p != s && *p == '\0') ? 0 : -1;
+}
+
+/*
+ * Check that an image file name is a safe printf() pattern for the
+ * frame number: exactly one integer conversion, such as %d or %03d,
+ * and any number of %%.
+ */
+int image_pattern_ok(const char *s)
+{
+	int convs = 0;
+
+	while ((s = strchr(s, '%')) != NULL) {
+		s++;
+		if (*s == '%') {
+			s++;
+			continue;
+		}
+		s += strspn(s, "-+ 0#");
+		s += strspn(s, "0123456789");
+		if (*s == '.')
+			s += 1 + strspn(s + 1, "0123456789");
+		if (*s != 'd' && *s != 'i')
+			return 0;
+		s++;
+		convs++;
+	}
+
+	return convs == 1;
+}
+
+/*
+ * Draw a single frame with the worker threads.
+ * For a zoom sequence, the image file name is a printf() pattern
+ * for the frame number, checked by image_pattern_ok(); a single
+ * frame goes to the file name as given.
+ */
+void draw_frame(int frame)
+{
+	char name[4096];
+	double t0, elapsed;
+
+	next_line = 0;
+	if (image_file) {
+		if (frames > 1)
+			snprintf(name, sizeof(name), image_file, frame);
+		else
+			snprintf(name, sizeof(name), "%s", image_file);
+		image_open(name);
+	} else if (!quiet) {
+		rob_reset(&rob);
+	}
+
+	t0 = now_sec();
+	pthread_barrier_wait(&frame_start);
+	if (!image_file && !quiet)
+		write_frame(&rob);
+	pthread_barrier_wait(&frame_done);
+	elapsed = now_sec() - t0;
+	total_elapsed += elapsed;
+
+	if (image_file) {
+		image_close();
+		fprintf(stderr, "Rendered %dx%d pixels to %s in %.3f s, %.2f Mpixels/s\n",
+			x_chars, y_chars, name, elapsed,
+			(double)x_chars * y_chars / elapsed / 1e6);
+	}
+}
+
+/*
+ * Per node: its share of the points, how fast it computed them
+ * while busy, and its throughput over the whole run.
+ */
+void report_nodes(struct thread_info_struct *thr)
+{
+	int i, node;
+	long points;
+	double busy;
+
+	for (node = 0; node < topo.nnodes; node++) {
+		points = 0;
+		busy = 0;
+		for (i = 0; i < N_THREADS; i++) {
+			points += thr[i].node_points[node];
+			busy += thr[i].node_busy[node];
+		}
+		if (points == 0)
+			continue;
+		fprintf(stderr, "Node %d: %ld points, %.2f Mpoints/s busy, "
+			"%.2f Mpoints/s overall\n", node, points,
+			busy > 0 ? points / busy / 1e6 : 0.0,
+			total_elapsed > 0 ? points / total_elapsed / 1e6 : 0.0);
+	}
+}
+
+/*
+ * Report how evenly work was spread among threads.
+ * The imbalance ratio is the busiest thread's time over the mean;
+ * 1.0 means every thread did the same amount of work.
+ */
+void report_threads(struct thread_info_struct *thr)
+{
+	int i;
+	long points = 0;
+	double sum = 0, max = 0;
+
+	for (i = 0; i < N_THREADS; i++) {
+		points += thr[i].points;
+		fprintf(stderr, "Thread %d: %d lines, busy %.3f ms, stalled %.3f ms",
+			i, thr[i].lines, thr[i].busy * 1e3, thr[i].stall * 1e3);
+		if (thr[i].cpu >= 0)
+			fprintf(stderr, ", CPU %d (node %d)", thr[i].cpu,
+				cpu_topology_node(&topo, thr[i].cpu));
+		fprintf(stderr, "\n");
+		sum += thr[i].busy;
+		if (thr[i].busy > max)
+			max = thr[i].busy;
+	}
+	fprintf(stderr, "Load imbalance (max / mean busy time): %.3f\n",
+		sum > 0 ? max / (sum / N_THREADS) : 1.0);
+	fprintf(stderr, "Elapsed: %.6f s for %d frames\n", total_elapsed, frames);
+	fprintf(stderr, "Points computed: %ld of %ld (%.1f%%)\n",
+		points, (long)x_chars * y_chars * frames,
+		100.0 * points / ((double)x_chars * y_chars * frames));
+	report_nodes(thr);
+	if (kernel == KERNEL_AUTO) {
+		fprintf(stderr, "Kernels:");
+		for (i = 0; i < KERNEL_AUTO; i++)
+			if (kernel_frames[i])
+				fprintf(stderr, " %s %d", kernel_name[i], kernel_frames[i]);
+		fprintf(stderr, " frames\n");
+	}
+	if (kernel_frames[KERNEL_DEEP])
+		fprintf(stderr, "Reference orbit: %d iterations, %d rebases\n",
+			orbit.len, glitches);
+}
+
+void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-s static|dynamic] [-c chunk] [-a] [-b slots] [-v] [-q]\n"
+		"          [-g WIDTHxHEIGHT] [-o image.ppm|image.pgm]\n"
+		"          [-C X,Y] [-z zoom] [-i iterations] [-n frames -e X,Y,zoom]\n"
+		"          [-k double|float|fixed|deep|auto] [-t tiles] [-T cache_file]\n"
+		"          [-p compact|scatter] [-S] <N_THREADS>\n\n"
+		"    -s: How lines are distributed among threads (default: dynamic).\n"
+		"    -c: Number of consecutive lines in a tile (default: 1, or %d with -a).\n"
+		"    -a: Compute tiles by successive refinement, skipping the inside of\n"
+		"        rectangles whose border has a single color.\n"
+		"    -b: Lines buffered for ordered output (default: 2 * N_THREADS * chunk).\n"
+		"    -v: Report per-thread busy time and load imbalance.\n"
+		"    -q: Only compute, do not output anything, e.g. for benchmarks.\n"
+		"    -g: Size of the output, in characters or pixels (default: 90x50).\n"
+		"    -o: Render into a PPM (or PGM) image file instead of the terminal.\n"
+		"    -C: Center of the view on the complex plane (default: -0.4,0).\n"
+		"    -z: Magnification, zoom 1 shows the whole set (default: 1).\n"
+		"    -i: Maximum number of iterations per point (default: %d).\n"
+		"    -n: Render a zoom sequence of this many frames, ending at -e.\n"
+		"        The image file name must contain one integer printf() pattern\n"
+		"        for the frame number, e.g. f%%03d.ppm.\n"
+		"    -k: Compute points in double or single precision, in 32-bit fixed point,\n"
+		"        or as perturbations of a double-double reference orbit, for zooms\n"
+		"        past 1e13; auto picks the cheapest accurate one (default: double).\n"
+		"    -t: Cache up to this many %dx%d tiles in memory, snapping the view\n"
+		"        to the cache's grid (default: %d with -T).\n"
+		"    -T: Keep cached tiles in this file too, across runs.\n"
+		"    -p: Pin workers to CPUs, filling one NUMA node after the other,\n"
+		"        or spreading them evenly over the nodes.\n"
+		"    -S: Smooth coloring, without bands, for image output\n"
+		"        in double precision.\n",
+		argv0, REFINE_DEFAULT_CHUNK, MANDEL_MAX_ITERATION,
+		TILE_SIZE, TILE_SIZE, cache_tiles);
+	exit(1);
+}
+
 void int_handler(int signum) {
     printf("Caught SIGINT signal! Reseting terminal color and exiting!\n");
 	reset_xterm_color(1);
@@ -153,55 +1031,210 @@ void int_handler(int signum) {
 
 int main(int argc, char* argv[])
 {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:c:ab:vqg:o:C:z:i:n:e:k:t:T:p:S")) != -1) {
+		switch (opt) {
+		case 's':
+			if (strcmp(optarg, "static") == 0)
+				sched = SCHED_STATIC;
+			else if (strcmp(optarg, "dynamic") == 0)
+				sched = SCHED_DYNAMIC;
+			else
+				usage(argv[0]);
+			break;
+		case 'c':
+			chunk = atoi(optarg);
+			if (chunk <= 0)
+				usage(argv[0]);
+			break;
+		case 'a':
+			refine = 1;
+			break;
+		case 'b':
+			rob_slots = atoi(optarg);
+			if (rob_slots <= 0)
+				usage(argv[0]);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'g':
+			if (sscanf(optarg, "%dx%d", &x_chars, &y_chars) != 2 ||
+			    x_chars <= 0 || y_chars <= 0)
+				usage(argv[0]);
+			break;
+		case 'o':
+			image_file = optarg;
+			break;
+		case 'C':
+			if (parse_point(optarg, &center_x, &center_y, NULL) < 0)
+				usage(argv[0]);
+			break;
+		case 'z':
+			zoom = atof(optarg);
+			if (zoom <= 0)
+				usage(argv[0]);
+			break;
+		case 'i':
+			max_iteration = atoi(optarg);
+			if (max_iteration <= 0)
+				usage(argv[0]);
+			break;
+		case 'n':
+			frames = atoi(optarg);
+			if (frames <= 0)
+				usage(argv[0]);
+			break;
+		case 'e':
+			if (parse_point(optarg, &end_x, &end_y, &end_zoom) < 0 ||
+			    end_zoom <= 0)
+				usage(argv[0]);
+			break;
+		case 'k':
+			for (kernel = 0; kernel <= KERNEL_AUTO; kernel++)
+				if (strcmp(optarg, kernel_name[kernel]) == 0)
+					break;
+			if (kernel > KERNEL_AUTO)
+				usage(argv[0]);
+			break;
+		case 't':
+			use_cache = 1;
+			cache_tiles = atoi(optarg);
+			if (cache_tiles <= 0)
+				usage(argv[0]);
+			break;
+		case 'T':
+			use_cache = 1;
+			cache_file = optarg;
+			break;
+		case 'S':
+			smooth = 1;
+			break;
+		case 'p':
+			if (strcmp(optarg, "compact") == 0)
+				place = PLACE_COMPACT;
+			else if (strcmp(optarg, "scatter") == 0)
+				place = PLACE_SCATTER;
+			else
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
     // Check if sufficient arguments have been provided
-    if (argc != 2) {
-        printf("Usage: ./mandel <N_THREADS>\n");
-        exit(1);
-    }
+    if (argc - optind != 1)
+        usage(argv[0]);
 
-    N_THREADS = atoi(argv[1]);
+    N_THREADS = atoi(argv[optind]);
+    if (N_THREADS <= 0)
+        usage(argv[0]);
+    if (frames > 1 && (end_zoom == 0 || (image_file && !image_pattern_ok(image_file))))
+        usage(argv[0]);
+    /* Cached tiles are computed in double precision, refinement does not apply */
+    if (use_cache && (kernel != KERNEL_DOUBLE || refine))
+        usage(argv[0]);
+    /* Smooth values go straight into an image, a line at a time */
+    if (smooth && (!image_file || kernel != KERNEL_DOUBLE || refine || use_cache))
+        usage(argv[0]);
+    if (chunk == 0)
+        chunk = use_cache ? TILE_SIZE : refine ? REFINE_DEFAULT_CHUNK : 1;
+    if (use_cache)
+        tile_cache_init(&cache, cache_tiles, cache_file,
+            (size_t)cache_tiles * CACHE_DISK_SLOTS_PER_TILE);
     printf("Running for N_THREADS = %d\n", N_THREADS);
 
    struct sigaction action;
    action.sa_handler = int_handler;
    sigaction (SIGINT, &action, NULL);
 
-    /* Allocate memory space for semaphores, initialize
-     * them to 0, excpet for the semaphore[0] wich shoulde
-     * be initialized to value 1
-     */
-    semaphore = safe_malloc(N_THREADS * sizeof(sem_t));
-    sem_init(&semaphore[0], 0, 1);
-    int i = 0;
-    for (i = 1; i < N_THREADS; i++) {
-        sem_init(&semaphore[i], 0, 0);
-    }
+	int line, frame, ret;
+	double t;
+	pthread_attr_t attr;
+	cpu_set_t set;
 
-	int line;
+    // Allocate space for per-thread info
+    struct thread_info_struct *thr = safe_malloc(N_THREADS * sizeof(*thr));
 
-	xstep = (xmax - xmin) / x_chars;
-	ystep = (ymax - ymin) / y_chars;
-
-    // Allocate space for threads type
-    pthread_t *threads = safe_malloc(N_THREADS * sizeof(pthread_t));
-    int* args = safe_malloc(N_THREADS * sizeof(int));
+	/*
+	 * A slot per line in flight is enough for workers to never wait,
+	 * twice that absorbs jitter in the writer.
+	 */
+	if (!image_file && !quiet) {
+		if (rob_slots == 0)
+			rob_slots = 2 * N_THREADS * chunk;
+		rob_init(&rob, rob_slots);
+	}
 
+	pthread_barrier_init(&frame_start, NULL, N_THREADS + 1);
+	pthread_barrier_init(&frame_done, NULL, N_THREADS + 1);
 
 	/*
 	 * draw the Mandelbrot Set, one line at a time.
 	 * Output is sent to file descriptor '1', i.e., standard output.
 	 */
 
+	cpu_topology_init(&topo);
+
     // Create N_THREADS
 	for (line = 0; line < N_THREADS; line++) {
-        args[line] = line;
-        pthread_create(&threads[line], NULL, thread_function, &args[line]);
+        thr[line].thrid = line;
+        thr[line].lines = 0;
+        thr[line].points = 0;
+        thr[line].tile_val = NULL;
+        thr[line].busy = 0;
+        thr[line].stall = 0;
+        thr[line].node_points = safe_malloc(topo.nnodes * sizeof(long));
+        thr[line].node_busy = safe_malloc(topo.nnodes * sizeof(double));
+        memset(thr[line].node_points, 0, topo.nnodes * sizeof(long));
+        memset(thr[line].node_busy, 0, topo.nnodes * sizeof(double));
+
+        pthread_attr_init(&attr);
+        thr[line].cpu = -1;
+        if (place >= 0) {
+            thr[line].cpu = cpu_topology_place(&topo, line, place);
+            CPU_ZERO(&set);
+            CPU_SET(thr[line].cpu, &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        ret = pthread_create(&thr[line].tid, &attr, thread_function, &thr[line]);
+        if (ret) {
+            perror_pthread(ret, "pthread_create");
+            exit(1);
+        }
+        pthread_attr_destroy(&attr);
+	}
+
+	for (frame = 0; frame < frames; frame++) {
+		t = (frames > 1) ? (double)frame / (frames - 1) : 0;
+		set_viewport(dd_add(center_x, dd_mul_d(dd_sub(end_x, center_x), t)),
+			dd_add(center_y, dd_mul_d(dd_sub(end_y, center_y), t)),
+			zoom * pow(end_zoom / zoom, t));
+		draw_frame(frame);
 	}
 
+	/* Release the workers one last time, to exit */
+	quit = 1;
+	pthread_barrier_wait(&frame_start);
+
 	for (line = 0; line < N_THREADS; line++) {
-        pthread_join(threads[line], NULL);
+        pthread_join(thr[line].tid, NULL);
     }
 
-	reset_xterm_color(1);
+	if (!image_file && !quiet)
+		reset_xterm_color(1);
+
+	if (verbose)
+		report_threads(thr);
+	if (use_cache) {
+		fprintf(stderr, "Tile cache: %ld hits, %ld disk hits, %ld misses\n",
+			cache.hits, cache.disk_hits, cache.misses);
+		tile_cache_destroy(&cache);
+	}
 	return 0;
 }
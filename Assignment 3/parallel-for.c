@@ -0,0 +1,222 @@
+/*
+ * parallel-for.c
+ *
+ * A persistent pool of threads, and a parallel for loop running on it.
+ *
+ * The threads are created once, and sleep on a futex between loops.
+ * The thread calling parallel_for() takes part in the loop as
+ * thread 0, and returns when all iterations are done.
+ *
+ * Optionally, thread i is pinned to CPU cpus[i], so that memory it
+ * touches first is placed on its NUMA node, and stays close to it.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "parallel-for.h"
+#include "sync-lib.h"
+
+#define perror_pthread(ret, msg) \
+	do { errno = ret; perror(msg); } while (0)
+
+/* Default chunk sizes, in iterations */
+#define PFOR_DYNAMIC_CHUNK 4096
+#define PFOR_GUIDED_CHUNK 64
+
+struct pfor_worker {
+	pthread_t tid;
+	struct pfor_pool *pool;
+	int thrid;
+};
+
+/* Run this thread's share of the current loop */
+static void pfor_run(struct pfor_pool *p, int thrid)
+{
+	long n, nchunks, s, e, c;
+	int t = p->nthreads;
+
+	switch (p->schedule) {
+	case PFOR_STATIC:
+		/* Block boundaries fall on multiples of chunk */
+		n = p->hi - p->lo;
+		nchunks = (n + p->chunk - 1) / p->chunk;
+		s = p->lo + nchunks * thrid / t * p->chunk;
+		e = p->lo + nchunks * (thrid + 1) / t * p->chunk;
+		if (e > p->hi)
+			e = p->hi;
+		if (s < e)
+			p->fn(s, e, thrid, p->arg);
+		break;
+
+	case PFOR_DYNAMIC:
+		while ((s = __atomic_fetch_add(&p->next, p->chunk, __ATOMIC_RELAXED)) < p->hi) {
+			e = s + p->chunk;
+			p->fn(s, e < p->hi ? e : p->hi, thrid, p->arg);
+		}
+		break;
+
+	case PFOR_GUIDED:
+		s = __atomic_load_n(&p->next, __ATOMIC_RELAXED);
+		while (s < p->hi) {
+			c = (p->hi - s) / (2 * t);
+			if (c < p->chunk)
+				c = p->chunk;
+			if (!__atomic_compare_exchange_n(&p->next, &s, s + c, 0,
+			    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				continue;
+			e = s + c;
+			p->fn(s, e < p->hi ? e : p->hi, thrid, p->arg);
+			s = __atomic_load_n(&p->next, __ATOMIC_RELAXED);
+		}
+		break;
+	}
+}
+
+static void *pfor_worker_fn(void *arg)
+{
+	struct pfor_worker *w = arg;
+	struct pfor_pool *p = w->pool;
+	int seen = 0, g;
+
+	for (;;) {
+		while ((g = __atomic_load_n(&p->gen, __ATOMIC_ACQUIRE)) == seen)
+			futex_wait(&p->gen, seen);
+		seen = g;
+		if (p->quit)
+			break;
+
+		pfor_run(p, w->thrid);
+		if (__atomic_sub_fetch(&p->pending, 1, __ATOMIC_ACQ_REL) == 0)
+			futex_wake(&p->pending, 1);
+	}
+
+	return NULL;
+}
+
+/* Start the next loop on all threads, and wait for the others to finish */
+static void pfor_go(struct pfor_pool *p)
+{
+	int n;
+
+	__atomic_store_n(&p->pending, p->nthreads - 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&p->gen, 1, __ATOMIC_RELEASE);
+	futex_wake(&p->gen, INT_MAX);
+
+	pfor_run(p, 0);
+
+	while ((n = __atomic_load_n(&p->pending, __ATOMIC_ACQUIRE)) != 0)
+		futex_wait(&p->pending, n);
+}
+
+/*
+ * Create a pool of nthreads, the caller included.
+ * If cpus is not NULL, thread i runs on CPU cpus[i] only; the caller
+ * gets its own affinity back in pfor_pool_destroy().
+ */
+void pfor_pool_init(struct pfor_pool *p, int nthreads, const int *cpus)
+{
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int i, ret;
+
+	memset(p, 0, sizeof(*p));
+	p->nthreads = nthreads;
+	p->workers = sync_malloc(nthreads * sizeof(*p->workers));
+
+	if (cpus) {
+		p->saved = sync_malloc(sizeof(cpu_set_t));
+		pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), p->saved);
+		CPU_ZERO(&set);
+		CPU_SET(cpus[0], &set);
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (ret)
+			perror_pthread(ret, "pthread_setaffinity_np");
+	}
+
+	for (i = 1; i < nthreads; i++) {
+		p->workers[i].pool = p;
+		p->workers[i].thrid = i;
+		pthread_attr_init(&attr);
+		if (cpus) {
+			CPU_ZERO(&set);
+			CPU_SET(cpus[i], &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		}
+		ret = pthread_create(&p->workers[i].tid, &attr,
+			pfor_worker_fn, &p->workers[i]);
+		if (ret) {
+			perror_pthread(ret, "pthread_create");
+			exit(1);
+		}
+		pthread_attr_destroy(&attr);
+	}
+}
+
+void pfor_pool_destroy(struct pfor_pool *p)
+{
+	int i, ret;
+
+	p->quit = 1;
+	__atomic_store_n(&p->pending, 0, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&p->gen, 1, __ATOMIC_RELEASE);
+	futex_wake(&p->gen, INT_MAX);
+
+	for (i = 1; i < p->nthreads; i++) {
+		ret = pthread_join(p->workers[i].tid, NULL);
+		if (ret)
+			perror_pthread(ret, "pthread_join");
+	}
+	free(p->workers);
+
+	if (p->saved) {
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), p->saved);
+		free(p->saved);
+	}
+}
+
+/*
+ * Run fn over [lo, hi) on all threads of the pool.
+ * chunk is the granularity of the schedule, 0 for its default:
+ * for PFOR_STATIC, blocks are multiples of it, so blocks of different
+ * threads need not share cache lines; for PFOR_DYNAMIC it is the
+ * size of every chunk, and for PFOR_GUIDED the smallest one.
+ */
+void parallel_for(struct pfor_pool *p, long lo, long hi,
+	int schedule, long chunk, pfor_body *fn, void *arg)
+{
+	if (hi <= lo)
+		return;
+
+	if (chunk <= 0)
+		chunk = schedule == PFOR_DYNAMIC ? PFOR_DYNAMIC_CHUNK :
+			schedule == PFOR_GUIDED ? PFOR_GUIDED_CHUNK : 1;
+
+	p->lo = lo;
+	p->hi = hi;
+	p->chunk = chunk;
+	p->schedule = schedule;
+	p->fn = fn;
+	p->arg = arg;
+	p->next = lo;
+
+	pfor_go(p);
+}
+
+/* A schedule by name, or -1 */
+int pfor_schedule(const char *name)
+{
+	if (strcmp(name, "static") == 0)
+		return PFOR_STATIC;
+	if (strcmp(name, "dynamic") == 0)
+		return PFOR_DYNAMIC;
+	if (strcmp(name, "guided") == 0)
+		return PFOR_GUIDED;
+	return -1;
+}
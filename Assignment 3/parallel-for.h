@@ -0,0 +1,51 @@
+/*
+ * parallel-for.h
+ *
+ * A persistent pool of threads, and a parallel for loop running on it.
+ *
+ */
+
+#ifndef PARALLEL_FOR_H__
+#define PARALLEL_FOR_H__
+
+#include <pthread.h>
+
+#include "sync-lib.h"
+
+/* How the iterations are split among the threads */
+enum {
+	PFOR_STATIC,    /* One contiguous block per thread */
+	PFOR_DYNAMIC,   /* Chunks of a fixed size, to whoever is free */
+	PFOR_GUIDED     /* Like dynamic, with chunks shrinking to the end */
+};
+
+/* Run iterations [lo, hi), on thread thrid of the pool */
+typedef void pfor_body(long lo, long hi, int thrid, void *arg);
+
+struct pfor_worker;
+
+struct pfor_pool {
+	int nthreads;           /* Including the one calling parallel_for() */
+	struct pfor_worker *workers;
+	void *saved;            /* The caller's affinity, if pinned */
+
+	/* The loop being run */
+	long lo, hi, chunk;
+	int schedule;
+	pfor_body *fn;
+	void *arg;
+
+	long next __attribute__((aligned(SYNC_CACHE_LINE)));
+	int gen __attribute__((aligned(SYNC_CACHE_LINE)));
+	int pending __attribute__((aligned(SYNC_CACHE_LINE)));
+	int quit;
+};
+
+/* Function prototypes */
+void pfor_pool_init(struct pfor_pool *p, int nthreads, const int *cpus);
+void pfor_pool_destroy(struct pfor_pool *p);
+void parallel_for(struct pfor_pool *p, long lo, long hi,
+	int schedule, long chunk, pfor_body *fn, void *arg);
+int pfor_schedule(const char *name);
+
+#endif /* PARALLEL_FOR_H__ */
@@ -8,11 +8,19 @@
  *
  */
 
+#include <math.h>
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "cpu-topology.h"
+#include "parallel-for.h"
+#include "stream-kernels.h"
 
 #define VAL1 1.5
 #define VAL2 4.0
@@ -25,19 +33,26 @@
 #define perror_pthread(ret, msg) \
 	do { errno = ret; perror(msg); } while (0)
 
-/*
- * A (distinct) instance of this structure
- * is passed to each thread
- */
-struct thread_info_struct {
-	pthread_t tid; /* POSIX thread id, as returned by the library */
-
-	double *arr; /* Pointer to array to manipulate */
-	int len;
+/* What every thread needs to know about the loop */
+struct scale_arg {
+	double *arr;
 	double mul;
+};
+
+/* The STREAM suite: the kernels, in the order they run */
+enum { STREAM_COPY, STREAM_SCALE, STREAM_ADD, STREAM_TRIAD, STREAM_KERNELS };
 
-	int thrid; /* Application-defined thread id */
-	int thrcnt;
+const char *stream_name[] = { "copy", "scale", "add", "triad" };
+const size_t stream_bytes[] = {
+	STREAM_COPY_BYTES, STREAM_SCALE_BYTES, STREAM_ADD_BYTES, STREAM_TRIAD_BYTES
+};
+
+#define STREAM_Q 3.0
+
+struct stream_arg {
+	double *a, *b, *c;
+	int kernel;     /* A STREAM_* kernel, or -1 to initialize */
+	int nt;         /* Use non-temporal stores */
 };
 
 int safe_atoi(char *s, int *val)
@@ -68,44 +83,236 @@ void *safe_malloc(size_t size)
 
 void usage(char *argv0)
 {
-	fprintf(stderr, "Usage: %s thread_count array_size\n\n"
-		"Exactly two argument required:\n"
+	fprintf(stderr, "Usage: %s [-s schedule] [-c chunk] [-r reps] "
+		"[-S [-p compact|scatter]] thread_count array_size\n\n"
+		"Exactly two arguments required:\n"
 		"    thread_count: The number of threads to create.\n"
-		"    array_size: The size of the array to run with.\n",
+		"    array_size: The size of the array to run with.\n\n"
+		"Options:\n"
+		"    -s schedule: static, dynamic or guided (default: static).\n"
+		"    -c chunk: Chunk size of the schedule, in elements\n"
+		"       (default: a cache line for static, see parallel-for.c).\n"
+		"    -r reps: Scale the array this many times, and report\n"
+		"       the best bandwidth (default: 1, or 10 with -S).\n"
+		"    -S: Run the STREAM kernels instead, over three arrays of\n"
+		"       array_size elements, with 1 to thread_count threads,\n"
+		"       and print their bandwidth as CSV.\n"
+		"    -p compact|scatter: With -S, pin threads to CPUs, filling\n"
+		"       one NUMA node at a time, or spreading them over all.\n",
 		argv0);
 	exit(1);
 }
 
+double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 
-/* Start function for each thread */
-void *thread_start_fn(void *arg)
+void *alloc_array(size_t size)
 {
-	int i;
+	void *p;
 
-	/* We know arg points to an instance of thread_info_struct */
-	struct thread_info_struct *thr = arg;
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
 
-	fprintf(stderr, "Thread %d of %d. START.\n", thr->thrid, thr->thrcnt);
+	return p;
+}
+
+/*
+ * Loop body: scale a contiguous block of the array,
+ * which the compiler is free to vectorize.
+ */
+void scale_fn(long lo, long hi, int thrid, void *arg)
+{
+	struct scale_arg *a = arg;
+	double *arr = a->arr, mul = a->mul;
+	long i;
+
+	for (i = lo; i < hi; i++)
+		arr[i] *= mul;
+}
 
-	for (i = thr->thrid; i < thr->len; i += thr->thrcnt)
-		thr->arr[i] *= thr->mul;
+/*
+ * Loop body for the STREAM suite. Initializing the arrays with the same
+ * static blocks the kernels use means every page is first touched, so
+ * placed, by the thread that will use it.
+ */
+void stream_fn(long lo, long hi, int thrid, void *arg)
+{
+	struct stream_arg *sa = arg;
+	long i;
+
+	switch (sa->kernel) {
+	case -1:
+		for (i = lo; i < hi; i++) {
+			sa->a[i] = 1.0;
+			sa->b[i] = 2.0;
+			sa->c[i] = 0.0;
+		}
+		break;
+	case STREAM_COPY:
+		stream_copy(sa->c + lo, sa->a + lo, hi - lo, sa->nt);
+		break;
+	case STREAM_SCALE:
+		stream_scale(sa->b + lo, sa->c + lo, STREAM_Q, hi - lo, sa->nt);
+		break;
+	case STREAM_ADD:
+		stream_add(sa->c + lo, sa->a + lo, sa->b + lo, hi - lo, sa->nt);
+		break;
+	case STREAM_TRIAD:
+		stream_triad(sa->a + lo, sa->b + lo, sa->c + lo, STREAM_Q, hi - lo, sa->nt);
+		break;
+	}
+	if (sa->nt)
+		stream_fence();
+}
 
-	fprintf(stderr, "Thread %d of %d. END.\n", thr->thrid, thr->thrcnt);
+/* Whether every element of arr is close enough to val */
+int stream_check(const double *arr, long n, double val)
+{
+	long i;
 
-    return NULL;
+	for (i = 0; i < n; i++)
+		if (fabs(arr[i] - val) > 1e-13 * fabs(val))
+			return 0;
+	return 1;
+}
+
+/*
+ * Run the STREAM kernels with 1 .. maxthreads threads, reps times each,
+ * with cached and with non-temporal stores, and report the best run.
+ * The arrays are allocated afresh for every thread count,
+ * so that they are first touched by the threads using them.
+ */
+void stream_suite(int maxthreads, long n, int reps, int place)
+{
+	struct cpu_topology topo;
+	struct pfor_pool pool;
+	struct stream_arg sa;
+	double best[STREAM_KERNELS], t, a, b, c;
+	long chunk = sysconf(_SC_PAGESIZE) / sizeof(double);
+	size_t size = n * sizeof(double);
+	int *cpus, thrcnt, i, k, rep;
+
+	cpu_topology_init(&topo);
+	cpus = safe_malloc(maxthreads * sizeof(*cpus));
+	for (i = 0; i < maxthreads; i++)
+		cpus[i] = cpu_topology_place(&topo, i, place);
+
+	printf("kernel,stores,threads,best_s,gb_per_s\n");
+	for (thrcnt = 1; thrcnt <= maxthreads; thrcnt++) {
+		pfor_pool_init(&pool, thrcnt, place >= 0 ? cpus : NULL);
+		sa.a = alloc_array(size);
+		sa.b = alloc_array(size);
+		sa.c = alloc_array(size);
+		sa.kernel = -1;
+		sa.nt = 0;
+		parallel_for(&pool, 0, n, PFOR_STATIC, chunk, stream_fn, &sa);
+		a = 1.0, b = 2.0, c = 0.0;
+
+		for (sa.nt = 0; sa.nt <= 1; sa.nt++) {
+			for (k = 0; k < STREAM_KERNELS; k++)
+				best[k] = 0;
+			for (rep = 0; rep < reps; rep++) {
+				for (k = 0; k < STREAM_KERNELS; k++) {
+					sa.kernel = k;
+					t = now_s();
+					parallel_for(&pool, 0, n, PFOR_STATIC, chunk, stream_fn, &sa);
+					t = now_s() - t;
+					if (best[k] == 0 || t < best[k])
+						best[k] = t;
+				}
+				c = a;
+				b = STREAM_Q * c;
+				c = a + b;
+				a = b + STREAM_Q * c;
+			}
+			for (k = 0; k < STREAM_KERNELS; k++)
+				printf("%s,%s,%d,%.6f,%.3f\n", stream_name[k],
+					sa.nt ? "nt" : "cached", thrcnt, best[k],
+					stream_bytes[k] * n / best[k] / 1e9);
+			fflush(stdout);
+		}
+
+		if (!stream_check(sa.a, n, a) || !stream_check(sa.b, n, b) ||
+		    !stream_check(sa.c, n, c)) {
+			fprintf(stderr, "Internal error: STREAM results are wrong "
+				"with %d threads\n", thrcnt);
+			exit(1);
+		}
+
+		munmap(sa.a, size);
+		munmap(sa.b, size);
+		munmap(sa.c, size);
+		pfor_pool_destroy(&pool);
+	}
+
+	free(cpus);
+	cpu_topology_destroy(&topo);
 }
 
 int main(int argc, char *argv[])
 {
-	double *arr;
-	int i, ret, arrsize, thrcnt;
-	struct thread_info_struct *thr;
+	double *arr, expect, t, best;
+	int i, opt, rep, arrsize, thrcnt;
+	int schedule = PFOR_STATIC, chunk = 0, reps = 0;
+	int stream = 0, place = -1;
+	struct scale_arg sa;
+	struct pfor_pool pool;
 
 	/*
 	 * Parse the command line
 	 */
-	if (argc != 3)
+	while ((opt = getopt(argc, argv, "s:c:r:Sp:")) != -1) {
+		switch (opt) {
+		case 's':
+			if ((schedule = pfor_schedule(optarg)) < 0) {
+				fprintf(stderr, "`%s' is not a valid schedule\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'c':
+			if (safe_atoi(optarg, &chunk) < 0 || chunk <= 0) {
+				fprintf(stderr, "`%s' is not a valid chunk size\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'r':
+			if (safe_atoi(optarg, &reps) < 0 || reps <= 0) {
+				fprintf(stderr, "`%s' is not a valid repetition count\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'S':
+			stream = 1;
+			break;
+		case 'p':
+			if (strcmp(optarg, "compact") == 0)
+				place = PLACE_COMPACT;
+			else if (strcmp(optarg, "scatter") == 0)
+				place = PLACE_SCATTER;
+			else {
+				fprintf(stderr, "`%s' is not a valid placement\n", optarg);
+				exit(1);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
 		usage(argv[0]);
+	argv += optind - 1;
+	if (reps == 0)
+		reps = stream ? 10 : 1;
 	if (safe_atoi(argv[1], &thrcnt) < 0 || thrcnt <= 0) {
 		fprintf(stderr, "`%s' is not valid for `thread_count'\n", argv[1]);
 		exit(1);
@@ -115,52 +322,60 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (stream) {
+		stream_suite(thrcnt, arrsize, reps, place);
+		return 0;
+	}
+
 	/*
-	 * Allocate and initialize big array of doubles
+	 * Allocate and initialize big array of doubles,
+	 * starting on a cache line boundary
 	 */
-	arr = safe_malloc(arrsize * sizeof(*arr));
+	if ((errno = posix_memalign((void **)&arr, SYNC_CACHE_LINE,
+	    arrsize * sizeof(*arr))) != 0) {
+		perror("posix_memalign");
+		exit(1);
+	}
 	for (i = 0; i < arrsize; i++)
 		arr[i] = VAL1;
 
 	/*
-	 * Multiply it by VAL2 using thrcnt threads, in parallel
+	 * Multiply it by VAL2 using thrcnt threads, in parallel.
+	 * Repetitions alternate between multiplying by VAL2 and dividing
+	 * by it, both exact, so the result can still be checked.
+	 * Static blocks default to whole cache lines, so no line
+	 * is written by two threads.
 	 */
-	thr = safe_malloc(thrcnt * sizeof(*thr));
-
-	for (i = 0; i < thrcnt; i++) {
-		/* Initialize per-thread structure */
-		thr[i].arr = arr;
-		thr[i].len = arrsize;
-		thr[i].mul = VAL2;
-		thr[i].thrid = i;
-		thr[i].thrcnt = thrcnt;
-
-		/* Spawn new thread */
-		ret = pthread_create(&thr[i].tid, NULL, thread_start_fn, &thr[i]);
-		if (ret) {
-			perror_pthread(ret, "pthread_create");
-			exit(1);
-		}
-	}
+	if (schedule == PFOR_STATIC && chunk == 0)
+		chunk = SYNC_CACHE_LINE / sizeof(*arr);
+	pfor_pool_init(&pool, thrcnt, NULL);
 
-	/*
-	 * Wait for all threads to terminate
-	 */
-	for (i = 0; i < thrcnt; i++) {
-		ret = pthread_join(thr[i].tid, NULL);
-		if (ret) {
-			perror_pthread(ret, "pthread_join");
-			exit(1);
-		}
+	sa.arr = arr;
+	best = 0;
+	for (rep = 0; rep < reps; rep++) {
+		sa.mul = rep % 2 ? 1 / VAL2 : VAL2;
+		t = now_s();
+		parallel_for(&pool, 0, arrsize, schedule, chunk, scale_fn, &sa);
+		t = now_s() - t;
+		if (best == 0 || t < best)
+			best = t;
 	}
 
+	pfor_pool_destroy(&pool);
+
+	/* Every element is read and written once per repetition */
+	fprintf(stderr, "Scale: %d threads, %d elements, best %.3f ms, %.2f GB/s\n",
+		thrcnt, arrsize, best * 1e3,
+		2.0 * arrsize * sizeof(*arr) / best / 1e9);
+
 	/*
 	 * Verify resulting values
 	 */
+	expect = reps % 2 ? VAL1 * VAL2 : VAL1;
 	for (i = 0; i < arrsize; i++)
-		if (arr[i] != VAL1 * VAL2) {
+		if (arr[i] != expect) {
 			fprintf(stderr, "Internal error: arr[%d] = %f, not %f\n",
-				i, arr[i], VAL1 * VAL2);
+				i, arr[i], expect);
 			exit(1);
 	}
 
@@ -0,0 +1,397 @@
+/*
+ * ring-bench.c
+ *
+ * A benchmark for the queues of ring.c: producers send messages
+ * to consumers through one queue, for every combination of 1 .. N
+ * producers and 1 .. M consumers, with every kind of queue.
+ *
+ * Every run reports messages per second, and percentiles of the time
+ * messages spend in the queue, from a sample of them.
+ * Results go to stdout, as CSV.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "lat-hist.h"
+#include "ring.h"
+#include "sync-lib.h"
+#include "tpool.h"
+
+#define CACHE_LINE 64
+
+/* Failed tries before a spinning thread yields the CPU */
+#define SPIN_LIMIT 1024
+
+/* One message in LAT_SAMPLE carries the time it was sent */
+#define LAT_SAMPLE 64
+
+#define MAX_BATCH 1024
+
+/* Message values: 0 is a plain message, STOP tells a consumer to leave */
+#define MSG_STOP UINTPTR_MAX
+
+/*********************************
+ *                               *
+ * Queues                        *
+ *                               *
+ *********************************/
+
+enum { MODE_SPIN, MODE_WAIT, MODE_BATCH };
+
+struct queue_kind {
+	const char *name;
+	int spsc;               /* Only for one producer, one consumer */
+	int mode;
+	const char *help;
+} kinds[] = {
+	{ "mpmc",       0, MODE_SPIN,  "MPMC ring, spinning when full or empty" },
+	{ "mpmc-wait",  0, MODE_WAIT,  "MPMC ring, sleeping when full or empty" },
+	{ "mpmc-batch", 0, MODE_BATCH, "MPMC ring, batches of -b messages" },
+	{ "spsc",       1, MODE_SPIN,  "SPSC ring, spinning when full or empty" },
+	{ "spsc-wait",  1, MODE_WAIT,  "SPSC ring, sleeping when full or empty" },
+	{ "spsc-batch", 1, MODE_BATCH, "SPSC ring, batches of -b messages" },
+};
+#define NKINDS (int)(sizeof(kinds) / sizeof(kinds[0]))
+
+struct queue_kind *kind;
+struct mpmc_ring mpmc;
+struct spsc_ring spsc;
+int batch = 32;
+
+/* Yield now and then, so runs with more threads than CPUs progress */
+void backoff(int *spins)
+{
+	cpu_relax();
+	if (++*spins % SPIN_LIMIT == 0)
+		sched_yield();
+}
+
+/* Send n messages; return how many, fewer only if told to stop */
+int send_msgs(void **msg, int n, volatile int *stop)
+{
+	int sent = 0, spins = 0;
+
+	while (sent < n) {
+		switch (kind->mode) {
+		case MODE_WAIT:
+			if (kind->spsc)
+				spsc_enqueue_wait(&spsc, msg[sent]);
+			else
+				mpmc_enqueue_wait(&mpmc, msg[sent]);
+			sent++;
+			continue;
+		case MODE_SPIN:
+			if (kind->spsc ? spsc_enqueue(&spsc, msg[sent]) :
+			    mpmc_enqueue(&mpmc, msg[sent])) {
+				sent++;
+				continue;
+			}
+			break;
+		case MODE_BATCH:
+			sent += kind->spsc ?
+				spsc_enqueue_batch(&spsc, msg + sent, n - sent) :
+				mpmc_enqueue_batch(&mpmc, msg + sent, n - sent);
+			if (sent == n)
+				continue;
+			break;
+		}
+		if (stop && *stop)
+			break;
+		backoff(&spins);
+	}
+
+	return sent;
+}
+
+/* Receive at least one message, and up to n */
+int recv_msgs(void **msg, int n)
+{
+	int got = 0, spins = 0;
+
+	for (;;) {
+		switch (kind->mode) {
+		case MODE_WAIT:
+			msg[0] = kind->spsc ? spsc_dequeue_wait(&spsc) :
+				mpmc_dequeue_wait(&mpmc);
+			return 1;
+		case MODE_SPIN:
+			got = kind->spsc ? spsc_dequeue(&spsc, msg) :
+				mpmc_dequeue(&mpmc, msg);
+			break;
+		case MODE_BATCH:
+			got = kind->spsc ? spsc_dequeue_batch(&spsc, msg, n) :
+				mpmc_dequeue_batch(&mpmc, msg, n);
+			break;
+		}
+		if (got)
+			return got;
+		backoff(&spins);
+	}
+}
+
+/*********************************
+ *                               *
+ * Benchmark                     *
+ *                               *
+ *********************************/
+
+struct thread_info_struct {
+	int thrid;
+	long msgs;              /* Sent, or received */
+	long lat[LAT_BUCKETS];  /* Consumers: latency histogram */
+} __attribute__((aligned(CACHE_LINE)));
+
+struct {
+	volatile int stop;
+} __attribute__((aligned(CACHE_LINE))) run;
+
+struct tpool pool;
+uint64_t t_start;
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * A producer sends batches of messages until told to stop.
+ * Sampled messages carry their send time, relative to the start
+ * of the run, plus one so that it is never 0.
+ */
+void *producer_fn(void *arg)
+{
+	struct thread_info_struct *thr = arg;
+	void *msg[MAX_BATCH];
+	int i, n = (kind->mode == MODE_BATCH) ? batch : 1;
+	long sent = 0;
+
+	while (!run.stop) {
+		for (i = 0; i < n; i++)
+			msg[i] = (void *)(uintptr_t)((sent + i) % LAT_SAMPLE ? 0 :
+				now_ns() - t_start + 1);
+		sent += send_msgs(msg, n, &run.stop);
+	}
+	thr->msgs = sent;
+
+	return NULL;
+}
+
+/* A consumer receives messages until it gets a MSG_STOP */
+void *consumer_fn(void *arg)
+{
+	struct thread_info_struct *thr = arg;
+	void *msg[MAX_BATCH];
+	uintptr_t v;
+	long got = 0;
+	int i, n;
+
+	for (;;) {
+		n = recv_msgs(msg, kind->mode == MODE_BATCH ? batch : 1);
+		for (i = 0; i < n; i++) {
+			v = (uintptr_t)msg[i];
+			if (v == MSG_STOP) {
+				/* Whatever follows is another consumer's STOP */
+				if (i + 1 < n)
+					send_msgs(msg + i + 1, n - i - 1, NULL);
+				thr->msgs = got;
+				return NULL;
+			}
+			got++;
+			if (v)
+				thr->lat[lat_bucket(now_ns() - t_start + 1 - v)]++;
+		}
+	}
+}
+
+/* Run one kind of queue with np producers and nc consumers */
+void bench(int np, int nc, double duration, size_t size)
+{
+	struct thread_info_struct *thr;
+	struct tpool_future *fut;
+	struct timespec ts;
+	long sent = 0, got = 0, sampled = 0;
+	long lat[LAT_BUCKETS];
+	void *stop_msg = (void *)MSG_STOP;
+	double elapsed;
+	int i, b;
+
+	fut = malloc((np + nc) * sizeof(*fut));
+	if (posix_memalign((void **)&thr, CACHE_LINE, (np + nc) * sizeof(*thr)) ||
+	    fut == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memset(thr, 0, (np + nc) * sizeof(*thr));
+
+	if (kind->spsc)
+		spsc_init(&spsc, size);
+	else
+		mpmc_init(&mpmc, size);
+	run.stop = 0;
+	t_start = now_ns();
+
+	for (i = 0; i < np + nc; i++) {
+		thr[i].thrid = i;
+		if (tpool_submit(&pool, i < np ? producer_fn : consumer_fn,
+		    &thr[i], &fut[i]) < 0) {
+			perror("tpool_submit");
+			exit(1);
+		}
+	}
+
+	ts.tv_sec = duration;
+	ts.tv_nsec = (duration - ts.tv_sec) * 1e9;
+	nanosleep(&ts, NULL);
+	run.stop = 1;
+
+	/* Once the producers are done, tell every consumer to leave */
+	for (i = 0; i < np; i++) {
+		tpool_future_get(&pool, &fut[i]);
+		sent += thr[i].msgs;
+	}
+	for (i = 0; i < nc; i++)
+		send_msgs(&stop_msg, 1, NULL);
+	memset(lat, 0, sizeof(lat));
+	for (i = np; i < np + nc; i++) {
+		tpool_future_get(&pool, &fut[i]);
+		got += thr[i].msgs;
+		for (b = 0; b < LAT_BUCKETS; b++) {
+			lat[b] += thr[i].lat[b];
+			sampled += thr[i].lat[b];
+		}
+	}
+	elapsed = (now_ns() - t_start) / 1e9;
+
+	if (kind->spsc)
+		spsc_destroy(&spsc);
+	else
+		mpmc_destroy(&mpmc);
+
+	printf("%s,%d,%d,%.3f,%ld,%.3f,%.3f,%.3f,%.3f,%s\n", kind->name, np, nc,
+		elapsed, got, got / elapsed / 1e6,
+		lat_quantile(lat, sampled, 0.50), lat_quantile(lat, sampled, 0.99),
+		lat_quantile(lat, sampled, 0.999), got == sent ? "OK" : "NOT OK");
+	fflush(stdout);
+
+	free(fut);
+	free(thr);
+}
+
+void usage(char *argv0)
+{
+	int i;
+
+	fprintf(stderr, "Usage: %s [-P producers] [-C consumers] [-d seconds]\n"
+		"          [-s size] [-b batch] [queue ...]\n\n"
+		"    -P, -C: Run with 1, 2, 4 .. up to this many producers and\n"
+		"        consumers, in every combination (default: 2 each).\n"
+		"    -d: Length of every run (default: 0.5).\n"
+		"    -s: Entries in the queue (default: 1024).\n"
+		"    -b: Messages per batch, for the batch queues (default: 32).\n\n"
+		"    Queues (default: all of them):\n", argv0);
+	for (i = 0; i < NKINDS; i++)
+		fprintf(stderr, "    %-10s %s\n", kinds[i].name, kinds[i].help);
+	fprintf(stderr, "\n    The SPSC queues only run with one producer and one consumer.\n"
+		"    Latency is sampled, one message in %d.\n", LAT_SAMPLE);
+	exit(1);
+}
+
+int safe_atoi(char *s, int *val)
+{
+	long l;
+	char *endp;
+
+	l = strtol(s, &endp, 10);
+	if (s != endp && *endp == '\0') {
+		*val = l;
+		return 0;
+	} else
+		return -1;
+}
+
+/* 1, 2, 4, ..., and max itself */
+int next_count(int n, int max)
+{
+	return (n < max && 2 * n > max) ? max : 2 * n;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, i, j, np, nc, max_p = 2, max_c = 2;
+	int size = 1024;
+	double duration = 0.5;
+	char *endp;
+
+	while ((opt = getopt(argc, argv, "P:C:d:s:b:")) != -1) {
+		switch (opt) {
+		case 'P':
+			if (safe_atoi(optarg, &max_p) < 0 || max_p <= 0)
+				usage(argv[0]);
+			break;
+		case 'C':
+			if (safe_atoi(optarg, &max_c) < 0 || max_c <= 0)
+				usage(argv[0]);
+			break;
+		case 'd':
+			duration = strtod(optarg, &endp);
+			if (endp == optarg || *endp != '\0' || duration <= 0)
+				usage(argv[0]);
+			break;
+		case 's':
+			if (safe_atoi(optarg, &size) < 0 || size <= 0)
+				usage(argv[0]);
+			break;
+		case 'b':
+			if (safe_atoi(optarg, &batch) < 0 || batch <= 0 ||
+			    batch > MAX_BATCH)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	for (i = optind; i < argc; i++) {
+		for (j = 0; j < NKINDS; j++)
+			if (strcmp(argv[i], kinds[j].name) == 0)
+				break;
+		if (j == NKINDS)
+			usage(argv[0]);
+	}
+
+	/* Every run needs all of its producers and consumers at once */
+	tpool_init(&pool, max_p + max_c, 0);
+
+	printf("queue,producers,consumers,seconds,msgs,mmsgs_per_s,"
+		"lat_p50_us,lat_p99_us,lat_p999_us,check\n");
+	for (j = 0; j < NKINDS; j++) {
+		if (optind < argc) {
+			for (i = optind; i < argc; i++)
+				if (strcmp(argv[i], kinds[j].name) == 0)
+					break;
+			if (i == argc)
+				continue;
+		}
+		kind = &kinds[j];
+		for (np = 1; np <= max_p; np = next_count(np, max_p))
+			for (nc = 1; nc <= max_c; nc = next_count(nc, max_c)) {
+				if (kind->spsc && (np > 1 || nc > 1))
+					continue;
+				bench(np, nc, duration, size);
+			}
+	}
+
+	tpool_shutdown(&pool);
+	return 0;
+}
@@ -0,0 +1,323 @@
+/*
+ * ring.c
+ *
+ * Bounded lock-free queues of pointers between threads.
+ * See ring.h.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "ring.h"
+#include "sync-lib.h"
+
+/* Tries before a _wait operation goes to sleep */
+#define RING_SPIN 128
+
+/* The smallest power of two >= n */
+static size_t pow2_ceil(size_t n)
+{
+	size_t p = 1;
+
+	while (p < n)
+		p <<= 1;
+	return p;
+}
+
+/*********************************
+ *                               *
+ * Waiting                       *
+ *                               *
+ *********************************/
+
+/*
+ * Sleep until woken through q, unless try() succeeds first.
+ * Counting ourselves as a waiter before the last try means that
+ * whoever makes try() succeed afterwards will see us, and wake us.
+ */
+#define RING_WAIT(q, try)						\
+	do {								\
+		int seen_, i_;						\
+									\
+		for (i_ = 0; i_ < RING_SPIN && !(try); i_++)		\
+			cpu_relax();					\
+		while (i_ == RING_SPIN) {				\
+			seen_ = __atomic_load_n(&(q)->seq, __ATOMIC_SEQ_CST); \
+			__atomic_add_fetch(&(q)->waiters, 1, __ATOMIC_SEQ_CST); \
+			if (try)					\
+				i_ = 0;					\
+			else						\
+				futex_wait(&(q)->seq, seen_);		\
+			__atomic_sub_fetch(&(q)->waiters, 1, __ATOMIC_SEQ_CST); \
+		}							\
+	} while (0)
+
+/* Wake one thread waiting on q, after making it possible for it to go on */
+static void ring_wake(struct ring_waitq *q)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->waiters, __ATOMIC_RELAXED) == 0)
+		return;
+	__atomic_add_fetch(&q->seq, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&q->seq, 1);
+}
+
+static void waitq_init(struct ring_waitq *q)
+{
+	q->seq = q->waiters = 0;
+}
+
+/*********************************
+ *                               *
+ * MPMC ring                     *
+ *                               *
+ *********************************/
+
+/* A ring of at least size entries; it is rounded up to a power of two */
+void mpmc_init(struct mpmc_ring *r, size_t size)
+{
+	size_t i;
+
+	size = pow2_ceil(size < 2 ? 2 : size);
+	r->cells = sync_malloc(size * sizeof(*r->cells));
+	r->mask = size - 1;
+	for (i = 0; i < size; i++)
+		r->cells[i].seq = i;
+	r->enq_pos = r->deq_pos = 0;
+	waitq_init(&r->not_empty);
+	waitq_init(&r->not_full);
+}
+
+void mpmc_destroy(struct mpmc_ring *r)
+{
+	free(r->cells);
+}
+
+/* Return nonzero on success, zero if the ring is full */
+int mpmc_enqueue(struct mpmc_ring *r, void *data)
+{
+	struct mpmc_cell *cell;
+	size_t pos = __atomic_load_n(&r->enq_pos, __ATOMIC_RELAXED);
+	intptr_t dif;
+
+	for (;;) {
+		cell = &r->cells[pos & r->mask];
+		dif = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->enq_pos, &pos, pos + 1, 1,
+			    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return 0;
+		else
+			pos = __atomic_load_n(&r->enq_pos, __ATOMIC_RELAXED);
+	}
+
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Return nonzero on success, zero if the ring is empty */
+int mpmc_dequeue(struct mpmc_ring *r, void **data)
+{
+	struct mpmc_cell *cell;
+	size_t pos = __atomic_load_n(&r->deq_pos, __ATOMIC_RELAXED);
+	intptr_t dif;
+
+	for (;;) {
+		cell = &r->cells[pos & r->mask];
+		dif = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t)(pos + 1);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->deq_pos, &pos, pos + 1, 1,
+			    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return 0;
+		else
+			pos = __atomic_load_n(&r->deq_pos, __ATOMIC_RELAXED);
+	}
+
+	*data = cell->data;
+	__atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Enqueue up to n entries, as many as there is room for, with a single
+ * CAS; return how many. The positions are claimed once their previous
+ * consumers have claimed them, but those may still be reading the
+ * cells, so each one is waited for before it is written.
+ */
+size_t mpmc_enqueue_batch(struct mpmc_ring *r, void **data, size_t n)
+{
+	struct mpmc_cell *cell;
+	size_t pos, room, i;
+
+	pos = __atomic_load_n(&r->enq_pos, __ATOMIC_RELAXED);
+	do {
+		room = r->mask + 1 - (pos - __atomic_load_n(&r->deq_pos, __ATOMIC_ACQUIRE));
+		if ((intptr_t)room <= 0)
+			return 0;
+		if (n > room)
+			n = room;
+	} while (!__atomic_compare_exchange_n(&r->enq_pos, &pos, pos + n, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	for (i = 0; i < n; i++) {
+		cell = &r->cells[(pos + i) & r->mask];
+		while (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + i)
+			cpu_relax();
+		cell->data = data[i];
+		__atomic_store_n(&cell->seq, pos + i + 1, __ATOMIC_RELEASE);
+	}
+
+	return n;
+}
+
+/* Dequeue up to n entries, as many as there are, with a single CAS */
+size_t mpmc_dequeue_batch(struct mpmc_ring *r, void **data, size_t n)
+{
+	struct mpmc_cell *cell;
+	size_t pos, avail, i;
+
+	pos = __atomic_load_n(&r->deq_pos, __ATOMIC_RELAXED);
+	do {
+		avail = __atomic_load_n(&r->enq_pos, __ATOMIC_ACQUIRE) - pos;
+		if ((intptr_t)avail <= 0)
+			return 0;
+		if (n > avail)
+			n = avail;
+	} while (!__atomic_compare_exchange_n(&r->deq_pos, &pos, pos + n, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	for (i = 0; i < n; i++) {
+		cell = &r->cells[(pos + i) & r->mask];
+		while (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + i + 1)
+			cpu_relax();
+		data[i] = cell->data;
+		__atomic_store_n(&cell->seq, pos + i + r->mask + 1, __ATOMIC_RELEASE);
+	}
+
+	return n;
+}
+
+void mpmc_enqueue_wait(struct mpmc_ring *r, void *data)
+{
+	RING_WAIT(&r->not_full, mpmc_enqueue(r, data));
+	ring_wake(&r->not_empty);
+}
+
+void *mpmc_dequeue_wait(struct mpmc_ring *r)
+{
+	void *data;
+
+	RING_WAIT(&r->not_empty, mpmc_dequeue(r, &data));
+	ring_wake(&r->not_full);
+	return data;
+}
+
+/*********************************
+ *                               *
+ * SPSC ring                     *
+ *                               *
+ *********************************/
+
+void spsc_init(struct spsc_ring *r, size_t size)
+{
+	size = pow2_ceil(size < 2 ? 2 : size);
+	r->slots = sync_malloc(size * sizeof(*r->slots));
+	r->mask = size - 1;
+	r->head = r->tail = 0;
+	r->tail_cache = r->head_cache = 0;
+	waitq_init(&r->not_empty);
+	waitq_init(&r->not_full);
+}
+
+void spsc_destroy(struct spsc_ring *r)
+{
+	free(r->slots);
+}
+
+/* Producer side: room for n more entries? */
+static int spsc_room(struct spsc_ring *r, size_t head, size_t n)
+{
+	if (head + n - r->tail_cache <= r->mask + 1)
+		return 1;
+	r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	return head + n - r->tail_cache <= r->mask + 1;
+}
+
+/* Consumer side: how many entries there are, as far as we know */
+static size_t spsc_avail(struct spsc_ring *r, size_t tail)
+{
+	if (r->head_cache != tail)
+		return r->head_cache - tail;
+	r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	return r->head_cache - tail;
+}
+
+int spsc_enqueue(struct spsc_ring *r, void *data)
+{
+	size_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+	if (!spsc_room(r, head, 1))
+		return 0;
+	r->slots[head & r->mask] = data;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+int spsc_dequeue(struct spsc_ring *r, void **data)
+{
+	size_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+	if (spsc_avail(r, tail) == 0)
+		return 0;
+	*data = r->slots[tail & r->mask];
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+size_t spsc_enqueue_batch(struct spsc_ring *r, void **data, size_t n)
+{
+	size_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	size_t i;
+
+	if (!spsc_room(r, head, n))
+		n = r->mask + 1 - (head - r->tail_cache);
+	for (i = 0; i < n; i++)
+		r->slots[(head + i) & r->mask] = data[i];
+	__atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+size_t spsc_dequeue_batch(struct spsc_ring *r, void **data, size_t n)
+{
+	size_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	size_t avail = spsc_avail(r, tail), i;
+
+	if (n > avail)
+		n = avail;
+	for (i = 0; i < n; i++)
+		data[i] = r->slots[(tail + i) & r->mask];
+	__atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+void spsc_enqueue_wait(struct spsc_ring *r, void *data)
+{
+	RING_WAIT(&r->not_full, spsc_enqueue(r, data));
+	ring_wake(&r->not_empty);
+}
+
+void *spsc_dequeue_wait(struct spsc_ring *r)
+{
+	void *data;
+
+	RING_WAIT(&r->not_empty, spsc_dequeue(r, &data));
+	ring_wake(&r->not_full);
+	return data;
+}
@@ -0,0 +1,88 @@
+/*
+ * ring.h
+ *
+ * Bounded lock-free queues of pointers between threads:
+ * a multi-producer multi-consumer ring, after Dmitry Vyukov's,
+ * and a single-producer single-consumer one.
+ *
+ * The plain operations never block, they fail when the ring is full
+ * or empty. The _wait ones sleep on a futex instead; note that only
+ * they wake up sleepers, so if either side may sleep, the other side
+ * must use the _wait operations as well.
+ *
+ */
+
+#ifndef RING_H__
+#define RING_H__
+
+#include <stddef.h>
+
+#include "sync-lib.h"
+
+/* Threads sleeping until the ring changes */
+struct ring_waitq {
+	int seq;                /* Futex word, bumped on every wakeup */
+	int waiters;
+} __attribute__((aligned(SYNC_CACHE_LINE)));
+
+/*
+ * Every cell has a sequence number, which says whose turn it is:
+ * seq == pos, free for the producer of position pos;
+ * seq == pos + 1, full, for the consumer of position pos.
+ * Producers and consumers claim positions with a CAS on enq_pos or
+ * deq_pos, and then only touch their own cell.
+ */
+struct mpmc_cell {
+	size_t seq;
+	void *data;
+};
+
+struct mpmc_ring {
+	struct mpmc_cell *cells;
+	size_t mask;
+
+	size_t enq_pos __attribute__((aligned(SYNC_CACHE_LINE)));
+	size_t deq_pos __attribute__((aligned(SYNC_CACHE_LINE)));
+
+	struct ring_waitq not_empty;
+	struct ring_waitq not_full;
+};
+
+/*
+ * With a single producer and a single consumer, each side owns its
+ * index, and keeps a copy of the other's, so it only reads the other
+ * side's cache line when the copy says the ring is full, or empty.
+ */
+struct spsc_ring {
+	void **slots;
+	size_t mask;
+
+	size_t head __attribute__((aligned(SYNC_CACHE_LINE)));
+	size_t tail_cache;      /* Producer's copy of tail */
+	size_t tail __attribute__((aligned(SYNC_CACHE_LINE)));
+	size_t head_cache;      /* Consumer's copy of head */
+
+	struct ring_waitq not_empty;
+	struct ring_waitq not_full;
+};
+
+/* Function prototypes */
+void mpmc_init(struct mpmc_ring *r, size_t size);
+void mpmc_destroy(struct mpmc_ring *r);
+int mpmc_enqueue(struct mpmc_ring *r, void *data);
+int mpmc_dequeue(struct mpmc_ring *r, void **data);
+size_t mpmc_enqueue_batch(struct mpmc_ring *r, void **data, size_t n);
+size_t mpmc_dequeue_batch(struct mpmc_ring *r, void **data, size_t n);
+void mpmc_enqueue_wait(struct mpmc_ring *r, void *data);
+void *mpmc_dequeue_wait(struct mpmc_ring *r);
+
+void spsc_init(struct spsc_ring *r, size_t size);
+void spsc_destroy(struct spsc_ring *r);
+int spsc_enqueue(struct spsc_ring *r, void *data);
+int spsc_dequeue(struct spsc_ring *r, void **data);
+size_t spsc_enqueue_batch(struct spsc_ring *r, void **data, size_t n);
+size_t spsc_dequeue_batch(struct spsc_ring *r, void **data, size_t n);
+void spsc_enqueue_wait(struct spsc_ring *r, void *data);
+void *spsc_dequeue_wait(struct spsc_ring *r);
+
+#endif /* RING_H__ */
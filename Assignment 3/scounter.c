@@ -0,0 +1,124 @@
+/*
+ * scounter.c
+ *
+ * A scalable counter, with a shard per thread. See scounter.h.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "scounter.h"
+
+#define SCOUNTER_DEFAULT_BATCH 1024
+
+__thread int scounter_slot = -1;
+
+/*
+ * Slots of threads that have exited, to hand out again,
+ * so that the slot numbers stay as low as the number of live threads.
+ */
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+static int *free_slots;
+static int nfree, free_alloc;
+static int next_slot;
+
+/* Runs when a thread that has a slot exits */
+static void slot_release(void *arg)
+{
+	int slot = (intptr_t)arg - 1;
+
+	pthread_mutex_lock(&slot_lock);
+	if (nfree == free_alloc) {
+		free_alloc = free_alloc ? 2 * free_alloc : 64;
+		free_slots = realloc(free_slots, free_alloc * sizeof(*free_slots));
+		if (free_slots == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	free_slots[nfree++] = slot;
+	pthread_mutex_unlock(&slot_lock);
+}
+
+static void slot_init(void)
+{
+	if (pthread_key_create(&slot_key, slot_release) != 0) {
+		fprintf(stderr, "scounter: pthread_key_create failed\n");
+		exit(1);
+	}
+}
+
+/*
+ * Give the calling thread a slot. Its shard in every counter keeps
+ * what earlier owners of the slot added, so nothing is lost.
+ */
+int scounter_slot_claim(void)
+{
+	int slot;
+
+	pthread_once(&slot_once, slot_init);
+
+	pthread_mutex_lock(&slot_lock);
+	slot = nfree ? free_slots[--nfree] : next_slot++;
+	pthread_mutex_unlock(&slot_lock);
+
+	pthread_setspecific(slot_key, (void *)(intptr_t)(slot + 1));
+	scounter_slot = slot;
+	return slot;
+}
+
+/*
+ * Set up a counter with nshards shards (0: one per configured CPU),
+ * folding every batch updates (0: a default).
+ */
+void scounter_init(struct scounter *c, int nshards, long batch)
+{
+	size_t len;
+
+	if (nshards <= 0)
+		nshards = sysconf(_SC_NPROCESSORS_CONF);
+	if (batch <= 0)
+		batch = SCOUNTER_DEFAULT_BATCH;
+
+	len = nshards * sizeof(*c->shards);
+	c->shards = sync_malloc_aligned(len);
+	memset(c->shards, 0, len);
+
+	c->count = 0;
+	c->nshards = nshards;
+	c->batch = batch;
+}
+
+void scounter_destroy(struct scounter *c)
+{
+	free(c->shards);
+	c->shards = NULL;
+	c->nshards = 0;
+}
+
+/* The shared count: off by at most nshards * batch */
+long scounter_read(const struct scounter *c)
+{
+	return __atomic_load_n(&c->count, __ATOMIC_RELAXED);
+}
+
+/*
+ * The shared count plus every shard. With concurrent updates,
+ * a shard being folded may be counted twice or not at all.
+ */
+long scounter_read_exact(const struct scounter *c)
+{
+	long sum = __atomic_load_n(&c->count, __ATOMIC_RELAXED);
+	int i;
+
+	for (i = 0; i < c->nshards; i++)
+		sum += __atomic_load_n(&c->shards[i].val, __ATOMIC_RELAXED);
+	return sum;
+}
@@ -0,0 +1,78 @@
+/*
+ * scounter.h
+ *
+ * A scalable counter: every thread adds to a shard of its own,
+ * on its own cache line, so updates from different threads never
+ * write to the same line. The shared count, which they fold into,
+ * has a line of its own too.
+ *
+ * Once a shard's value reaches +-batch, it is folded into the shared
+ * count. scounter_read() only looks at that count, so it is cheap,
+ * but may be off by up to nshards * batch. scounter_read_exact() adds
+ * up the shards too; it is exact while nobody is updating the counter.
+ *
+ * Threads get a slot number the first time they touch any scounter, and
+ * give it back when they exit. A thread whose slot is past the shards of
+ * a counter adds to the shared count directly, with an atomic add.
+ *
+ */
+
+#ifndef SCOUNTER_H__
+#define SCOUNTER_H__
+
+#include "sync-lib.h"
+
+struct scounter_shard {
+	long val;
+} __attribute__((aligned(SYNC_CACHE_LINE)));
+
+/*
+ * The fields scounter_add() reads on every call share a line, apart
+ * from count, so that folding into count does not invalidate them.
+ */
+struct scounter {
+	int nshards __attribute__((aligned(SYNC_CACHE_LINE)));
+	long batch;
+	struct scounter_shard *shards;
+	long count __attribute__((aligned(SYNC_CACHE_LINE)));
+};
+
+/* This thread's slot, or -1 if it has none yet */
+extern __thread int scounter_slot;
+
+/* Function prototypes */
+void scounter_init(struct scounter *c, int nshards, long batch);
+void scounter_destroy(struct scounter *c);
+long scounter_read(const struct scounter *c);
+long scounter_read_exact(const struct scounter *c);
+int scounter_slot_claim(void);
+
+static inline void scounter_add(struct scounter *c, long v)
+{
+	struct scounter_shard *s;
+	int slot = scounter_slot;
+	long n;
+
+	if (slot < 0)
+		slot = scounter_slot_claim();
+	if (slot >= c->nshards) {
+		__atomic_fetch_add(&c->count, v, __ATOMIC_RELAXED);
+		return;
+	}
+
+	/* Only this thread writes its shard, no atomic add is needed */
+	s = &c->shards[slot];
+	n = s->val + v;
+	if (n >= c->batch || n <= -c->batch) {
+		__atomic_fetch_add(&c->count, n, __ATOMIC_RELAXED);
+		n = 0;
+	}
+	__atomic_store_n(&s->val, n, __ATOMIC_RELAXED);
+}
+
+static inline void scounter_sub(struct scounter *c, long v)
+{
+	scounter_add(c, -v);
+}
+
+#endif /* SCOUNTER_H__ */
@@ -0,0 +1,480 @@
+/*
+ * simplesync-bench.c
+ *
+ * A contention benchmark for the counter of simplesync.c:
+ * threads increase a shared counter as fast as they can, with
+ * one of several synchronization strategies, for 1 .. N threads.
+ *
+ * Every run reports operations per second and, where perf_event_open()
+ * is allowed, L1D read misses per operation: every time the counter's
+ * cache line moves to another core, that core misses on it.
+ * Results go to stdout, as CSV.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "cpu-topology.h"
+#include "scounter.h"
+#include "sync-lib.h"
+#include "tpool.h"
+
+#define perror_pthread(ret, msg) \
+	do { errno = ret; perror(msg); } while (0)
+
+#define CACHE_LINE 64
+#define MAX_THREADS 1024
+
+/*
+ * Spinning waiters yield the CPU every SPIN_LIMIT tries, so that
+ * runs with more threads than CPUs still make progress
+ * when the lock holder, or the next in line, is preempted.
+ */
+#define SPIN_LIMIT 1024
+
+/*********************************
+ *                               *
+ * Locks                         *
+ *                               *
+ *********************************/
+
+/* Test-and-test-and-set spinlock */
+struct spinlock {
+	int locked;
+} __attribute__((aligned(CACHE_LINE)));
+
+void spin_lock(struct spinlock *l)
+{
+	int spins = 0;
+
+	while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(&l->locked, __ATOMIC_RELAXED)) {
+			cpu_relax();
+			if (++spins % SPIN_LIMIT == 0)
+				sched_yield();
+		}
+}
+
+void spin_unlock(struct spinlock *l)
+{
+	__atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+/* Ticket lock: FIFO, but every waiter spins on the same line */
+struct ticketlock {
+	unsigned int next;
+	unsigned int serving;
+} __attribute__((aligned(CACHE_LINE)));
+
+void ticket_lock(struct ticketlock *l)
+{
+	unsigned int me = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+	int spins = 0;
+
+	while (__atomic_load_n(&l->serving, __ATOMIC_ACQUIRE) != me) {
+		cpu_relax();
+		if (++spins % SPIN_LIMIT == 0)
+			sched_yield();
+	}
+}
+
+void ticket_unlock(struct ticketlock *l)
+{
+	__atomic_store_n(&l->serving, l->serving + 1, __ATOMIC_RELEASE);
+}
+
+/*********************************
+ *                               *
+ * Strategies                    *
+ *                               *
+ *********************************/
+
+/*
+ * A thread's view of the benchmark. Each one is on its own cache line,
+ * so threads only share what the strategy makes them share.
+ */
+struct thread_info_struct {
+	int thrid;
+	int cpu;                /* CPU to pin to, or -1 */
+	long ops;               /* Increments done */
+	uint64_t misses;        /* L1D read misses, if counted */
+	int counted;            /* The misses are valid */
+	struct mcs_node node;   /* This thread's MCS queue node */
+} __attribute__((aligned(CACHE_LINE)));
+
+/* The shared counter, on its own line */
+struct {
+	volatile long val;
+} __attribute__((aligned(CACHE_LINE))) counter;
+
+/* Per-thread counters, one per line, or all packed into one or two */
+struct {
+	long val;
+} __attribute__((aligned(CACHE_LINE))) padded[MAX_THREADS];
+long packed[MAX_THREADS];
+
+/* A sharded counter, with a shard per thread */
+struct scounter scount;
+
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+struct spinlock spin;
+struct ticketlock ticket;
+struct futex_mutex fmutex = FUTEX_MUTEX_INITIALIZER;
+struct mcs_lock mcs = MCS_LOCK_INITIALIZER;
+struct rwlock rwl = RWLOCK_INITIALIZER;
+
+typedef void strategy_fn(struct thread_info_struct *thr);
+
+void inc_mutex(struct thread_info_struct *thr)
+{
+	pthread_mutex_lock(&mutex);
+	++counter.val;
+	pthread_mutex_unlock(&mutex);
+}
+
+void inc_spin(struct thread_info_struct *thr)
+{
+	spin_lock(&spin);
+	++counter.val;
+	spin_unlock(&spin);
+}
+
+void inc_ticket(struct thread_info_struct *thr)
+{
+	ticket_lock(&ticket);
+	++counter.val;
+	ticket_unlock(&ticket);
+}
+
+void inc_futex(struct thread_info_struct *thr)
+{
+	futex_mutex_lock(&fmutex);
+	++counter.val;
+	futex_mutex_unlock(&fmutex);
+}
+
+void inc_mcs(struct thread_info_struct *thr)
+{
+	mcs_lock(&mcs, &thr->node);
+	++counter.val;
+	mcs_unlock(&mcs, &thr->node);
+}
+
+void inc_rwlock(struct thread_info_struct *thr)
+{
+	rwlock_write_lock(&rwl);
+	++counter.val;
+	rwlock_write_unlock(&rwl);
+}
+
+void inc_sync(struct thread_info_struct *thr)
+{
+	__sync_fetch_and_add(&counter.val, 1);
+}
+
+void inc_relaxed(struct thread_info_struct *thr)
+{
+	__atomic_fetch_add(&counter.val, 1, __ATOMIC_RELAXED);
+}
+
+void inc_seqcst(struct thread_info_struct *thr)
+{
+	__atomic_fetch_add(&counter.val, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Per-thread counters are only written by their owner, but may be read
+ * by anyone at any time, so they are updated with atomic stores.
+ */
+void inc_padded(struct thread_info_struct *thr)
+{
+	long *p = &padded[thr->thrid].val;
+
+	__atomic_store_n(p, *p + 1, __ATOMIC_RELAXED);
+}
+
+void inc_packed(struct thread_info_struct *thr)
+{
+	long *p = &packed[thr->thrid];
+
+	__atomic_store_n(p, *p + 1, __ATOMIC_RELAXED);
+}
+
+void inc_scounter(struct thread_info_struct *thr)
+{
+	scounter_add(&scount, 1);
+}
+
+struct strategy {
+	const char *name;
+	strategy_fn *inc;
+	int per_thread;         /* Counts are elsewhere than in counter.val */
+	const char *help;
+} strategies[] = {
+	{ "mutex",   inc_mutex,   0, "pthread mutex around ++" },
+	{ "spin",    inc_spin,    0, "test-and-test-and-set spinlock around ++" },
+	{ "ticket",  inc_ticket,  0, "ticket lock around ++" },
+	{ "futex",   inc_futex,   0, "three-state futex mutex around ++" },
+	{ "mcs",     inc_mcs,     0, "MCS queue lock around ++" },
+	{ "rwlock",  inc_rwlock,  0, "reader-writer lock, as a writer, around ++" },
+	{ "sync",    inc_sync,    0, "__sync_fetch_and_add(), as in simplesync" },
+	{ "relaxed", inc_relaxed, 0, "__atomic_fetch_add(), relaxed" },
+	{ "seqcst",  inc_seqcst,  0, "__atomic_fetch_add(), sequentially consistent" },
+	{ "padded",  inc_padded,  1, "a counter per thread, one per cache line" },
+	{ "packed",  inc_packed,  1, "a counter per thread, sharing cache lines" },
+	{ "scounter", inc_scounter, 1, "scounter_add(), with a shard per thread" },
+};
+#define NSTRATEGIES (int)(sizeof(strategies) / sizeof(strategies[0]))
+
+/*********************************
+ *                               *
+ * Benchmark                     *
+ *                               *
+ *********************************/
+
+/*
+ * The threads of every run come from one pool, created once,
+ * so runs do not pay for creating and joining threads.
+ */
+struct tpool pool;
+
+struct strategy *strategy;
+pthread_barrier_t start;
+struct {
+	volatile int stop;
+} __attribute__((aligned(CACHE_LINE))) run;
+
+/* Count this thread's L1D read misses, in user space; -1 if not allowed */
+int perf_open(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_L1D |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void *thread_start_fn(void *arg)
+{
+	struct thread_info_struct *thr = arg;
+	strategy_fn *inc = strategy->inc;
+	cpu_set_t set;
+	long ops = 0;
+	int fd;
+
+	if (thr->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(thr->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+	fd = perf_open();
+
+	pthread_barrier_wait(&start);
+	if (fd >= 0)
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+
+	while (!run.stop) {
+		inc(thr);
+		ops++;
+	}
+
+	thr->counted = 0;
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		thr->counted = (read(fd, &thr->misses, sizeof(thr->misses)) ==
+			sizeof(thr->misses));
+		close(fd);
+	}
+	thr->ops = ops;
+
+	return NULL;
+}
+
+double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Run one strategy with nthreads threads, print a line of CSV */
+void bench(struct strategy *s, int nthreads, double duration,
+	struct cpu_topology *topo, int place)
+{
+	struct thread_info_struct *thr;
+	struct tpool_future *fut;
+	struct timespec ts;
+	long ops = 0, total;
+	uint64_t misses = 0;
+	int i, counted = 1;
+	double t0, elapsed;
+
+	thr = aligned_alloc(CACHE_LINE, nthreads * sizeof(*thr));
+	fut = malloc(nthreads * sizeof(*fut));
+	if (thr == NULL || fut == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	strategy = s;
+	counter.val = 0;
+	memset(padded, 0, sizeof(padded));
+	memset(packed, 0, sizeof(packed));
+	/* Pool workers keep their scounter slot from run to run */
+	scounter_init(&scount, pool.nworkers, 0);
+	run.stop = 0;
+	pthread_barrier_init(&start, NULL, nthreads + 1);
+
+	for (i = 0; i < nthreads; i++) {
+		thr[i].thrid = i;
+		thr[i].cpu = (place >= 0) ? cpu_topology_place(topo, i, place) : -1;
+		if (tpool_submit(&pool, thread_start_fn, &thr[i], &fut[i]) < 0) {
+			perror("tpool_submit");
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&start);
+	t0 = now_sec();
+	ts.tv_sec = duration;
+	ts.tv_nsec = (duration - ts.tv_sec) * 1e9;
+	nanosleep(&ts, NULL);
+	run.stop = 1;
+
+	for (i = 0; i < nthreads; i++) {
+		tpool_future_get(&pool, &fut[i]);
+		ops += thr[i].ops;
+		misses += thr[i].misses;
+		counted &= thr[i].counted;
+	}
+	elapsed = now_sec() - t0;
+	pthread_barrier_destroy(&start);
+
+	/* Reduce the per-thread counters, and check nothing was lost */
+	if (s->inc == inc_scounter)
+		total = scounter_read_exact(&scount);
+	else if (s->per_thread)
+		for (total = 0, i = 0; i < nthreads; i++)
+			total += (s->inc == inc_padded) ? padded[i].val : packed[i];
+	else
+		total = counter.val;
+	scounter_destroy(&scount);
+
+	printf("%s,%d,%.3f,%ld,%.2f,%.2f,", s->name, nthreads, elapsed, ops,
+		ops / elapsed / 1e6, elapsed * 1e9 * nthreads / ops);
+	if (counted)
+		printf("%.3f,", (double)misses / ops);
+	else
+		printf("NA,");
+	printf("%s\n", total == ops ? "OK" : "NOT OK");
+	fflush(stdout);
+
+	free(fut);
+	free(thr);
+}
+
+void usage(char *argv0)
+{
+	int i;
+
+	fprintf(stderr, "Usage: %s [-t max_threads] [-d seconds] [-p compact|scatter]\n"
+		"          [strategy ...]\n\n"
+		"    -t: Run with 1 .. max_threads threads (default: number of CPUs).\n"
+		"    -d: Length of every run (default: 0.5).\n"
+		"    -p: Pin threads to CPUs, filling one NUMA node after the other,\n"
+		"        or spreading them evenly over the nodes.\n\n"
+		"    Strategies (default: all of them):\n", argv0);
+	for (i = 0; i < NSTRATEGIES; i++)
+		fprintf(stderr, "    %-9s %s\n", strategies[i].name, strategies[i].help);
+	fprintf(stderr, "\n    ns_per_op is CPU time: elapsed time * threads / operations.\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct cpu_topology topo;
+	int opt, i, j, t, max_threads, place = -1;
+	double duration = 0.5;
+
+	cpu_topology_init(&topo);
+	max_threads = topo.ncpus;
+
+	while ((opt = getopt(argc, argv, "t:d:p:")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			if (max_threads <= 0 || max_threads > MAX_THREADS)
+				usage(argv[0]);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			if (duration <= 0)
+				usage(argv[0]);
+			break;
+		case 'p':
+			if (strcmp(optarg, "compact") == 0)
+				place = PLACE_COMPACT;
+			else if (strcmp(optarg, "scatter") == 0)
+				place = PLACE_SCATTER;
+			else
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	for (i = optind; i < argc; i++) {
+		for (j = 0; j < NSTRATEGIES; j++)
+			if (strcmp(argv[i], strategies[j].name) == 0)
+				break;
+		if (j == NSTRATEGIES)
+			usage(argv[0]);
+	}
+
+	if ((i = perf_open()) < 0)
+		fprintf(stderr, "perf_event_open: %s, cache misses will not be counted\n",
+			strerror(errno));
+	else
+		close(i);
+
+	/* Every run needs all of its threads at once, at the start barrier */
+	tpool_init(&pool, max_threads, 0);
+
+	printf("strategy,threads,seconds,ops,mops_per_s,ns_per_op,l1d_misses_per_op,check\n");
+	for (j = 0; j < NSTRATEGIES; j++) {
+		if (optind < argc) {
+			for (i = optind; i < argc; i++)
+				if (strcmp(argv[i], strategies[j].name) == 0)
+					break;
+			if (i == argc)
+				continue;
+		}
+		for (t = 1; t <= max_threads; t++)
+			bench(&strategies[j], t, duration, &topo, place);
+	}
+
+	tpool_shutdown(&pool);
+	cpu_topology_destroy(&topo);
+	return 0;
+}
@@ -14,6 +14,9 @@
 #include <unistd.h>
 #include <pthread.h>
 
+#include "sync-lib.h"
+#include "tpool.h"
+
 /*
  * POSIX thread functions do not return error numbers in errno,
  * but in the actual return value of the function call instead.
@@ -26,8 +29,10 @@
 
 /* Dots indicate lines where you are free to insert code at will */
 /* ... */
-#if defined(SYNC_ATOMIC) ^ defined(SYNC_MUTEX) == 0
-# error You must #define exactly one of SYNC_ATOMIC or SYNC_MUTEX.
+#if defined(SYNC_ATOMIC) + defined(SYNC_MUTEX) + defined(SYNC_FUTEX) + \
+    defined(SYNC_MCS) + defined(SYNC_RWLOCK) != 1
+# error You must #define exactly one of SYNC_ATOMIC, SYNC_MUTEX, \
+	SYNC_FUTEX, SYNC_MCS or SYNC_RWLOCK.
 #endif
 
 #if defined(SYNC_ATOMIC)
@@ -36,12 +41,42 @@
 # define USE_ATOMIC_OPS 0
 #endif
 
+/*
+ * The lock around the critical section. Besides a pthread mutex,
+ * it may be one of the locks of sync-lib.h. The MCS lock also needs
+ * a queue node per thread, which the other locks ignore.
+ */
+#if defined(SYNC_FUTEX)
+struct futex_mutex lock;
+# define lock_init(l)          (futex_mutex_init(l), 0)
+# define lock_acquire(l, node) ((void)(node), futex_mutex_lock(l))
+# define lock_release(l, node) ((void)(node), futex_mutex_unlock(l))
+# define lock_destroy(l)       do { } while (0)
+#elif defined(SYNC_MCS)
+struct mcs_lock lock;
+# define lock_init(l)          (mcs_init(l), 0)
+# define lock_acquire(l, node) mcs_lock(l, node)
+# define lock_release(l, node) mcs_unlock(l, node)
+# define lock_destroy(l)       do { } while (0)
+#elif defined(SYNC_RWLOCK)
+struct rwlock lock;
+# define lock_init(l)          (rwlock_init(l), 0)
+# define lock_acquire(l, node) ((void)(node), rwlock_write_lock(l))
+# define lock_release(l, node) ((void)(node), rwlock_write_unlock(l))
+# define lock_destroy(l)       do { } while (0)
+#else
 pthread_mutex_t lock;
+# define lock_init(l)          pthread_mutex_init(l, NULL)
+# define lock_acquire(l, node) ((void)(node), pthread_mutex_lock(l))
+# define lock_release(l, node) ((void)(node), pthread_mutex_unlock(l))
+# define lock_destroy(l)       pthread_mutex_destroy(l)
+#endif
 
 void *increase_fn(void *arg)
 {
 	int i;
 	volatile int *ip = arg;
+	struct mcs_node node;
 
 	fprintf(stderr, "About to increase variable %d times\n", N);
 	for (i = 0; i < N; i++) {
@@ -54,9 +89,9 @@ void *increase_fn(void *arg)
 		} else {
 			/* ... */
 			/* You cannot modify the following line */
-            pthread_mutex_lock(&lock);
+            lock_acquire(&lock, &node);
 			++(*ip);
-            pthread_mutex_unlock(&lock);
+            lock_release(&lock, &node);
 			/* ... */
 		}
 	}
@@ -69,6 +104,7 @@ void *decrease_fn(void *arg)
 {
 	int i;
 	volatile int *ip = arg;
+	struct mcs_node node;
 
 	fprintf(stderr, "About to decrease variable %d times\n", N);
 	for (i = 0; i < N; i++) {
@@ -79,10 +115,10 @@ void *decrease_fn(void *arg)
             __sync_fetch_and_sub (ip, 1);
 		} else {
 			/* ... */
-            pthread_mutex_lock(&lock);
+            lock_acquire(&lock, &node);
 			/* You cannot modify the following line */
 			--(*ip);
-            pthread_mutex_unlock(&lock);
+            lock_release(&lock, &node);
 			/* ... */
 		}
 	}
@@ -94,8 +130,9 @@ void *decrease_fn(void *arg)
 
 int main(int argc, char *argv[])
 {
-	int val, ret, ok;
-	pthread_t t1, t2;
+	int val, ok;
+	struct tpool pool;
+	struct tpool_future f1, f2;
 
 	/*
 	 * Initial value
@@ -103,34 +140,27 @@ int main(int argc, char *argv[])
 	val = 0;
 
     // Initialize lock
-    if (pthread_mutex_init(&lock, NULL) != 0) {
+    if (lock_init(&lock) != 0) {
         printf("\n mutex init failed\n");
         return 1;
     }
 
 	/*
-	 * Create threads
+	 * Run both on a pool of two threads
 	 */
-	ret = pthread_create(&t1, NULL, increase_fn, &val);
-	if (ret) {
-		perror_pthread(ret, "pthread_create");
-		exit(1);
-	}
-	ret = pthread_create(&t2, NULL, decrease_fn, &val);
-	if (ret) {
-		perror_pthread(ret, "pthread_create");
+	tpool_init(&pool, 2, 0);
+	if (tpool_submit(&pool, increase_fn, &val, &f1) < 0 ||
+	    tpool_submit(&pool, decrease_fn, &val, &f2) < 0) {
+		perror("tpool_submit");
 		exit(1);
 	}
 
 	/*
-	 * Wait for threads to terminate
+	 * Wait for them to finish
 	 */
-	ret = pthread_join(t1, NULL);
-	if (ret)
-		perror_pthread(ret, "pthread_join");
-	ret = pthread_join(t2, NULL);
-	if (ret)
-		perror_pthread(ret, "pthread_join");
+	tpool_future_get(&pool, &f1);
+	tpool_future_get(&pool, &f2);
+	tpool_shutdown(&pool);
 
 	/*
 	 * Is everything OK?
@@ -140,7 +170,7 @@ int main(int argc, char *argv[])
 	printf("%sOK, val = %d.\n", ok ? "" : "NOT ", val);
 
     // Destroy lock
-    pthread_mutex_destroy(&lock);
+    lock_destroy(&lock);
 
 	return ok;
 }
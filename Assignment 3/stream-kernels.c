@@ -0,0 +1,116 @@
+/*
+ * stream-kernels.c
+ *
+ * The four kernels of the STREAM memory bandwidth benchmark.
+ *
+ * Elements are processed a vector at a time, once the destination is
+ * aligned to one. Sources are loaded unaligned, which costs nothing
+ * when they are aligned as well, as with arrays allocated alike.
+ * Non-temporal stores need SSE2; without it, they are plain stores.
+ *
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "stream-kernels.h"
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#define STREAM_VEC_BYTES 16
+
+typedef double vdouble __attribute__((vector_size(STREAM_VEC_BYTES)));
+
+#define VLANES ((int)(sizeof(vdouble) / sizeof(double)))
+
+static inline vdouble load(const double *p)
+{
+	vdouble v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void store(double *p, vdouble v, int nt)
+{
+#ifdef __SSE2__
+	if (nt) {
+		_mm_stream_pd(p, (__m128d)v);
+		return;
+	}
+#endif
+	*(vdouble *)p = v;
+}
+
+/* Elements to do one at a time, before dst is vector-aligned */
+static inline long head(const double *dst, long n)
+{
+	long h = ((STREAM_VEC_BYTES - (uintptr_t)dst % STREAM_VEC_BYTES)
+		% STREAM_VEC_BYTES) / sizeof(double);
+
+	return h < n ? h : n;
+}
+
+void stream_copy(double *c, const double *a, long n, int nt)
+{
+	long i, h = head(c, n);
+
+	for (i = 0; i < h; i++)
+		c[i] = a[i];
+	for (; i + VLANES <= n; i += VLANES)
+		store(&c[i], load(&a[i]), nt);
+	for (; i < n; i++)
+		c[i] = a[i];
+}
+
+void stream_scale(double *b, const double *c, double q, long n, int nt)
+{
+	long i, h = head(b, n);
+	vdouble vq = (vdouble){0} + q;
+
+	for (i = 0; i < h; i++)
+		b[i] = q * c[i];
+	for (; i + VLANES <= n; i += VLANES)
+		store(&b[i], vq * load(&c[i]), nt);
+	for (; i < n; i++)
+		b[i] = q * c[i];
+}
+
+void stream_add(double *c, const double *a, const double *b, long n, int nt)
+{
+	long i, h = head(c, n);
+
+	for (i = 0; i < h; i++)
+		c[i] = a[i] + b[i];
+	for (; i + VLANES <= n; i += VLANES)
+		store(&c[i], load(&a[i]) + load(&b[i]), nt);
+	for (; i < n; i++)
+		c[i] = a[i] + b[i];
+}
+
+void stream_triad(double *a, const double *b, const double *c, double q,
+	long n, int nt)
+{
+	long i, h = head(a, n);
+	vdouble vq = (vdouble){0} + q;
+
+	for (i = 0; i < h; i++)
+		a[i] = b[i] + q * c[i];
+	for (; i + VLANES <= n; i += VLANES)
+		store(&a[i], load(&b[i]) + vq * load(&c[i]), nt);
+	for (; i < n; i++)
+		a[i] = b[i] + q * c[i];
+}
+
+/*
+ * Non-temporal stores are weakly ordered: a thread that wrote with them
+ * must fence before others may rely on seeing the results.
+ */
+void stream_fence(void)
+{
+#ifdef __SSE2__
+	_mm_sfence();
+#endif
+}
@@ -0,0 +1,34 @@
+/*
+ * stream-kernels.h
+ *
+ * The four kernels of the STREAM memory bandwidth benchmark,
+ * over arrays of doubles:
+ *
+ *   copy:  c[i] = a[i]
+ *   scale: b[i] = q * c[i]
+ *   add:   c[i] = a[i] + b[i]
+ *   triad: a[i] = b[i] + q * c[i]
+ *
+ * With nt set, results are written with non-temporal stores,
+ * which go around the caches and skip reading the destination first.
+ *
+ */
+
+#ifndef STREAM_KERNELS_H__
+#define STREAM_KERNELS_H__
+
+/* Bytes moved per element by each kernel, as STREAM counts them */
+#define STREAM_COPY_BYTES  (2 * sizeof(double))
+#define STREAM_SCALE_BYTES (2 * sizeof(double))
+#define STREAM_ADD_BYTES   (3 * sizeof(double))
+#define STREAM_TRIAD_BYTES (3 * sizeof(double))
+
+/* Function prototypes */
+void stream_copy(double *c, const double *a, long n, int nt);
+void stream_scale(double *b, const double *c, double q, long n, int nt);
+void stream_add(double *c, const double *a, const double *b, long n, int nt);
+void stream_triad(double *a, const double *b, const double *c, double q,
+	long n, int nt);
+void stream_fence(void);
+
+#endif /* STREAM_KERNELS_H__ */
@@ -0,0 +1,307 @@
+/*
+ * sync-lib.c
+ *
+ * A small library of locks, built on atomics and futexes.
+ * See sync-lib.h.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "sync-lib.h"
+
+/*
+ * malloc(), for this library and the modules built on it,
+ * exiting if there is no memory left.
+ */
+void *sync_malloc(size_t size)
+{
+	void *p;
+
+	if ((p = malloc(size)) == NULL) {
+		fprintf(stderr, "Out of memory, failed to allocate %zd bytes\n",
+			size);
+		exit(1);
+	}
+
+	return p;
+}
+
+/* The same, starting on a cache line of its own */
+void *sync_malloc_aligned(size_t size)
+{
+	void *p;
+
+	if (posix_memalign(&p, SYNC_CACHE_LINE, size) != 0) {
+		fprintf(stderr, "Out of memory, failed to allocate %zd bytes\n",
+			size);
+		exit(1);
+	}
+
+	return p;
+}
+
+/*
+ * Sleep while *addr == val. May return early, callers re-check.
+ */
+void futex_wait(int *addr, int val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/* Wake up to n threads sleeping on addr */
+void futex_wake(int *addr, int n)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/*
+ * Adapt a spin limit, after a lock was taken with 'spins' spins
+ * (got == 1), or spinning gave up and the thread slept (got == 0).
+ * Racy updates are fine, it is only a hint.
+ */
+static void spin_adapt(int *limit, int spins, int got)
+{
+	int l = __atomic_load_n(limit, __ATOMIC_RELAXED);
+
+	if (got)
+		l += (2 * spins - l) / 8;
+	else
+		l -= l / 8;
+
+	if (l < SYNC_SPIN_MIN)
+		l = SYNC_SPIN_MIN;
+	if (l > SYNC_SPIN_MAX)
+		l = SYNC_SPIN_MAX;
+	__atomic_store_n(limit, l, __ATOMIC_RELAXED);
+}
+
+/*********************************
+ *                               *
+ * Futex mutex                   *
+ *                               *
+ *********************************/
+
+/*
+ * The three-state mutex of Drepper's "Futexes Are Tricky": unlocking
+ * only enters the kernel if the mutex was marked as having sleepers.
+ */
+void futex_mutex_init(struct futex_mutex *m)
+{
+	m->val = 0;
+	m->spin_limit = SYNC_SPIN_MIN;
+}
+
+int futex_mutex_trylock(struct futex_mutex *m)
+{
+	int c = 0;
+
+	return __atomic_compare_exchange_n(&m->val, &c, 1, 0,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void futex_mutex_lock(struct futex_mutex *m)
+{
+	int c, spins, limit;
+
+	if (futex_mutex_trylock(m))
+		return;
+
+	limit = __atomic_load_n(&m->spin_limit, __ATOMIC_RELAXED);
+	for (spins = 1; spins <= limit; spins++) {
+		cpu_relax();
+		if (__atomic_load_n(&m->val, __ATOMIC_RELAXED) == 0 &&
+		    futex_mutex_trylock(m)) {
+			spin_adapt(&m->spin_limit, spins, 1);
+			return;
+		}
+	}
+	spin_adapt(&m->spin_limit, spins, 0);
+
+	/* Mark the mutex as contended, and sleep until it is free */
+	while ((c = __atomic_exchange_n(&m->val, 2, __ATOMIC_ACQUIRE)) != 0)
+		futex_wait(&m->val, 2);
+}
+
+void futex_mutex_unlock(struct futex_mutex *m)
+{
+	if (__atomic_fetch_sub(&m->val, 1, __ATOMIC_RELEASE) != 1) {
+		__atomic_store_n(&m->val, 0, __ATOMIC_RELEASE);
+		futex_wake(&m->val, 1);
+	}
+}
+
+/*********************************
+ *                               *
+ * MCS lock                      *
+ *                               *
+ *********************************/
+
+void mcs_init(struct mcs_lock *l)
+{
+	l->tail = NULL;
+	l->spin_limit = SYNC_SPIN_MIN;
+}
+
+void mcs_lock(struct mcs_lock *l, struct mcs_node *me)
+{
+	struct mcs_node *prev;
+	int spins, limit, w = 1;
+
+	me->next = NULL;
+	me->wait = 1;
+	prev = __atomic_exchange_n(&l->tail, me, __ATOMIC_ACQ_REL);
+	if (prev == NULL)
+		return;
+	__atomic_store_n(&prev->next, me, __ATOMIC_RELEASE);
+
+	limit = __atomic_load_n(&l->spin_limit, __ATOMIC_RELAXED);
+	for (spins = 1; spins <= limit; spins++) {
+		if (__atomic_load_n(&me->wait, __ATOMIC_ACQUIRE) == 0) {
+			spin_adapt(&l->spin_limit, spins, 1);
+			return;
+		}
+		cpu_relax();
+	}
+	spin_adapt(&l->spin_limit, spins, 0);
+
+	/* Tell our predecessor we are asleep, unless it handed over already */
+	if (__atomic_compare_exchange_n(&me->wait, &w, 2, 0,
+	    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(&me->wait, __ATOMIC_ACQUIRE) != 0)
+			futex_wait(&me->wait, 2);
+}
+
+void mcs_unlock(struct mcs_lock *l, struct mcs_node *me)
+{
+	struct mcs_node *next = __atomic_load_n(&me->next, __ATOMIC_ACQUIRE);
+	struct mcs_node *expected = me;
+
+	if (next == NULL) {
+		if (__atomic_compare_exchange_n(&l->tail, &expected, NULL, 0,
+		    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+		/* Someone is queueing behind us, wait for the link */
+		while ((next = __atomic_load_n(&me->next, __ATOMIC_ACQUIRE)) == NULL)
+			cpu_relax();
+	}
+
+	/*
+	 * The successor may return, and reuse its node, as soon as it sees
+	 * wait == 0; waking a futex on reused memory is harmless.
+	 */
+	if (__atomic_exchange_n(&next->wait, 0, __ATOMIC_RELEASE) == 2)
+		futex_wake(&next->wait, 1);
+}
+
+/*********************************
+ *                               *
+ * Reader-writer lock            *
+ *                               *
+ *********************************/
+
+void rwlock_init(struct rwlock *l)
+{
+	l->state = 0;
+	l->writers_waiting = 0;
+	l->sleepers = 0;
+	l->spin_limit = SYNC_SPIN_MIN;
+}
+
+/*
+ * Sleep on state, unless it has changed from what the caller saw, or
+ * 'blocked' no longer holds. Announcing ourselves in sleepers first
+ * means whoever changes state afterwards will see us and wake us.
+ */
+static void rwlock_sleep(struct rwlock *l, int reader)
+{
+	int s, blocked;
+
+	__atomic_fetch_add(&l->sleepers, 1, __ATOMIC_SEQ_CST);
+	s = __atomic_load_n(&l->state, __ATOMIC_SEQ_CST);
+	if (reader)
+		blocked = s < 0 || __atomic_load_n(&l->writers_waiting, __ATOMIC_SEQ_CST);
+	else
+		blocked = s != 0;
+	if (blocked)
+		futex_wait(&l->state, s);
+	__atomic_fetch_sub(&l->sleepers, 1, __ATOMIC_RELAXED);
+}
+
+static void rwlock_wake(struct rwlock *l)
+{
+	if (__atomic_load_n(&l->sleepers, __ATOMIC_SEQ_CST))
+		futex_wake(&l->state, INT_MAX);
+}
+
+static int rwlock_try_read(struct rwlock *l)
+{
+	int s = __atomic_load_n(&l->state, __ATOMIC_RELAXED);
+
+	return s >= 0 && __atomic_load_n(&l->writers_waiting, __ATOMIC_RELAXED) == 0 &&
+		__atomic_compare_exchange_n(&l->state, &s, s + 1, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static int rwlock_try_write(struct rwlock *l)
+{
+	int s = 0;
+
+	return __atomic_compare_exchange_n(&l->state, &s, -1, 0,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void rwlock_read_lock(struct rwlock *l)
+{
+	int spins, limit;
+
+	for (;;) {
+		limit = __atomic_load_n(&l->spin_limit, __ATOMIC_RELAXED);
+		for (spins = 1; spins <= limit; spins++) {
+			if (rwlock_try_read(l)) {
+				spin_adapt(&l->spin_limit, spins, 1);
+				return;
+			}
+			cpu_relax();
+		}
+		spin_adapt(&l->spin_limit, spins, 0);
+		rwlock_sleep(l, 1);
+	}
+}
+
+void rwlock_read_unlock(struct rwlock *l)
+{
+	if (__atomic_sub_fetch(&l->state, 1, __ATOMIC_SEQ_CST) == 0)
+		rwlock_wake(l);
+}
+
+void rwlock_write_lock(struct rwlock *l)
+{
+	int spins, limit;
+
+	__atomic_fetch_add(&l->writers_waiting, 1, __ATOMIC_SEQ_CST);
+	for (;;) {
+		limit = __atomic_load_n(&l->spin_limit, __ATOMIC_RELAXED);
+		for (spins = 1; spins <= limit; spins++) {
+			if (rwlock_try_write(l)) {
+				spin_adapt(&l->spin_limit, spins, 1);
+				__atomic_fetch_sub(&l->writers_waiting, 1, __ATOMIC_SEQ_CST);
+				return;
+			}
+			cpu_relax();
+		}
+		spin_adapt(&l->spin_limit, spins, 0);
+		rwlock_sleep(l, 0);
+	}
+}
+
+void rwlock_write_unlock(struct rwlock *l)
+{
+	__atomic_store_n(&l->state, 0, __ATOMIC_SEQ_CST);
+	rwlock_wake(l);
+}
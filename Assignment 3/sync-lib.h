@@ -0,0 +1,99 @@
+/*
+ * sync-lib.h
+ *
+ * A small library of locks, built on atomics and futexes:
+ * a three-state futex mutex, an MCS queue lock, and a reader-writer lock.
+ *
+ * All of them spin for a while before going to sleep in the kernel.
+ * How long is adapted per lock: the spin limit follows twice the number
+ * of spins it took to get the lock recently, and shrinks whenever
+ * spinning did not pay off and the thread had to sleep after all.
+ *
+ */
+
+#ifndef SYNC_LIB_H__
+#define SYNC_LIB_H__
+
+#include <stddef.h>
+
+/* Also what the modules built on this library align their fields to */
+#define SYNC_CACHE_LINE 64
+
+/* Bounds for the adaptive spin limits */
+#define SYNC_SPIN_MIN 16
+#define SYNC_SPIN_MAX 4096
+
+/* What to do in every turn of a spin loop */
+#if defined(__x86_64__) || defined(__i386__)
+# define cpu_relax() __builtin_ia32_pause()
+#else
+# define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/*
+ * Futex mutex.
+ * val is 0 when unlocked, 1 when locked, 2 when locked
+ * and there may be threads sleeping on it.
+ */
+struct futex_mutex {
+	int val;
+	int spin_limit;
+} __attribute__((aligned(SYNC_CACHE_LINE)));
+
+#define FUTEX_MUTEX_INITIALIZER { 0, SYNC_SPIN_MIN }
+
+/*
+ * MCS lock.
+ * Waiters queue up, each on a node of its own, and the lock is handed
+ * from one to the next, so every waiter only watches its own node.
+ * A node must stay around from mcs_lock() to the matching mcs_unlock().
+ */
+struct mcs_node {
+	struct mcs_node *next;
+	int wait;               /* 1 while waiting, 2 once asleep, 0 when ours */
+} __attribute__((aligned(SYNC_CACHE_LINE)));
+
+struct mcs_lock {
+	struct mcs_node *tail;
+	int spin_limit;
+} __attribute__((aligned(SYNC_CACHE_LINE)));
+
+#define MCS_LOCK_INITIALIZER { NULL, SYNC_SPIN_MIN }
+
+/*
+ * Reader-writer lock.
+ * state is the number of readers holding it, or -1 for a writer.
+ * Writers take precedence: no new readers get in while one is waiting.
+ */
+struct rwlock {
+	int state;
+	int writers_waiting;
+	int sleepers;           /* Threads asleep, or about to, on state */
+	int spin_limit;
+} __attribute__((aligned(SYNC_CACHE_LINE)));
+
+#define RWLOCK_INITIALIZER { 0, 0, 0, SYNC_SPIN_MIN }
+
+/* Function prototypes */
+void *sync_malloc(size_t size);
+void *sync_malloc_aligned(size_t size);
+
+void futex_wait(int *addr, int val);
+void futex_wake(int *addr, int n);
+
+void futex_mutex_init(struct futex_mutex *m);
+void futex_mutex_lock(struct futex_mutex *m);
+int futex_mutex_trylock(struct futex_mutex *m);
+void futex_mutex_unlock(struct futex_mutex *m);
+
+void mcs_init(struct mcs_lock *l);
+void mcs_lock(struct mcs_lock *l, struct mcs_node *me);
+void mcs_unlock(struct mcs_lock *l, struct mcs_node *me);
+
+void rwlock_init(struct rwlock *l);
+void rwlock_read_lock(struct rwlock *l);
+void rwlock_read_unlock(struct rwlock *l);
+void rwlock_write_lock(struct rwlock *l);
+void rwlock_write_unlock(struct rwlock *l);
+
+#endif /* SYNC_LIB_H__ */
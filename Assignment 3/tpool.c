@@ -0,0 +1,401 @@
+/*
+ * tpool.c
+ *
+ * A pool of worker threads, created once and reused, that run tasks.
+ * See tpool.h.
+ *
+ * Workers with nothing to do sleep on the futex word seq, which
+ * submitters bump before waking one of them. Announcing itself in
+ * sleepers before looking for work one last time means a worker is
+ * never asleep while a task it could run waits in a queue.
+ *
+ * A worker waiting for a future inside a task sleeps on seq as well,
+ * counted in sleepers, so it is woken for new tasks like an idle one;
+ * whoever completes a future that is waited for bumps seq too.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "tpool.h"
+#include "sync-lib.h"
+
+#define perror_pthread(ret, msg) \
+	do { errno = ret; perror(msg); } while (0)
+
+/* The worker running on this thread, if any */
+static __thread struct tpool_worker *tpool_self;
+
+/*********************************
+ *                               *
+ * Queues                        *
+ *                               *
+ *********************************/
+
+static void queue_init(struct tpool_queue *q, int cap)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+	q->slots = sync_malloc(cap * sizeof(*q->slots));
+	q->cap = cap;
+	q->head = q->count = 0;
+}
+
+static void queue_destroy(struct tpool_queue *q)
+{
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->not_full);
+	free(q->slots);
+}
+
+/* Add f at the tail, waiting for room if the queue is full */
+static void queue_push(struct tpool_queue *q, struct tpool_future *f)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == q->cap)
+		pthread_cond_wait(&q->not_full, &q->lock);
+	q->slots[(q->head + q->count++) % q->cap] = f;
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Add f at the tail if there is room; return nonzero if so */
+static int queue_trypush(struct tpool_queue *q, struct tpool_future *f)
+{
+	int ok;
+
+	pthread_mutex_lock(&q->lock);
+	if ((ok = q->count < q->cap))
+		q->slots[(q->head + q->count++) % q->cap] = f;
+	pthread_mutex_unlock(&q->lock);
+
+	return ok;
+}
+
+/* Take from the head, or return NULL if the queue is empty */
+static struct tpool_future *queue_pop(struct tpool_queue *q)
+{
+	struct tpool_future *f = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->count > 0) {
+		f = q->slots[q->head];
+		q->head = (q->head + 1) % q->cap;
+		if (q->count-- == q->cap)
+			pthread_cond_signal(&q->not_full);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return f;
+}
+
+static void deque_init(struct tpool_deque *d)
+{
+	futex_mutex_init(&d->lock);
+	d->top = d->bottom = 0;
+}
+
+/* The owner pushes at the bottom; return nonzero if there was room */
+static int deque_push(struct tpool_deque *d, struct tpool_future *f)
+{
+	int ok;
+
+	futex_mutex_lock(&d->lock);
+	if ((ok = d->bottom - d->top < TPOOL_DEQUE_CAP))
+		d->slots[d->bottom++ % TPOOL_DEQUE_CAP] = f;
+	futex_mutex_unlock(&d->lock);
+
+	return ok;
+}
+
+/* The owner pops the newest task, which is likely still in its cache */
+static struct tpool_future *deque_pop(struct tpool_deque *d)
+{
+	struct tpool_future *f = NULL;
+
+	if (__atomic_load_n(&d->bottom, __ATOMIC_RELAXED) ==
+	    __atomic_load_n(&d->top, __ATOMIC_RELAXED))
+		return NULL;
+
+	futex_mutex_lock(&d->lock);
+	if (d->bottom > d->top)
+		f = d->slots[--d->bottom % TPOOL_DEQUE_CAP];
+	futex_mutex_unlock(&d->lock);
+
+	return f;
+}
+
+/* Thieves take the oldest task */
+static struct tpool_future *deque_steal(struct tpool_deque *d)
+{
+	struct tpool_future *f = NULL;
+
+	if (__atomic_load_n(&d->bottom, __ATOMIC_RELAXED) ==
+	    __atomic_load_n(&d->top, __ATOMIC_RELAXED))
+		return NULL;
+
+	futex_mutex_lock(&d->lock);
+	if (d->bottom > d->top)
+		f = d->slots[d->top++ % TPOOL_DEQUE_CAP];
+	futex_mutex_unlock(&d->lock);
+
+	return f;
+}
+
+/*********************************
+ *                               *
+ * Workers                       *
+ *                               *
+ *********************************/
+
+/* Find something for worker w to run, or return NULL */
+static struct tpool_future *find_task(struct tpool_worker *w)
+{
+	struct tpool *p = w->pool;
+	struct tpool_future *f;
+	int i, v;
+
+	if ((f = deque_pop(&w->deque)) != NULL)
+		return f;
+	if ((f = queue_pop(&p->queue)) != NULL)
+		return f;
+
+	/* Start from a random victim, so thieves spread out */
+	v = rand_r(&w->seed) % p->nworkers;
+	for (i = 0; i < p->nworkers; i++, v = (v + 1) % p->nworkers)
+		if (v != w->id && (f = deque_steal(&p->workers[v].deque)) != NULL) {
+			w->steals++;
+			return f;
+		}
+
+	return NULL;
+}
+
+static void run_task(struct tpool *p, struct tpool_future *f)
+{
+	f->result = f->fn(f->arg);
+
+	if (f->detached) {
+		free(f);
+	} else if (__atomic_exchange_n(&f->state, 1, __ATOMIC_SEQ_CST) == 2) {
+		/* Waiters outside the pool sleep on state, workers on seq */
+		futex_wake(&f->state, INT_MAX);
+		if (__atomic_load_n(&p->sleepers, __ATOMIC_SEQ_CST) > 0) {
+			__atomic_add_fetch(&p->seq, 1, __ATOMIC_SEQ_CST);
+			futex_wake(&p->seq, INT_MAX);
+		}
+	}
+
+	if (__atomic_sub_fetch(&p->pending, 1, __ATOMIC_ACQ_REL) == 0)
+		futex_wake(&p->pending, INT_MAX);
+}
+
+/* Wake a sleeping worker, if there is one, as there is work for it */
+static void wake_worker(struct tpool *p)
+{
+	if (__atomic_load_n(&p->sleepers, __ATOMIC_SEQ_CST) == 0)
+		return;
+	__atomic_add_fetch(&p->seq, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&p->seq, 1);
+}
+
+static void *worker_fn(void *arg)
+{
+	struct tpool_worker *w = arg;
+	struct tpool *p = w->pool;
+	struct tpool_future *f;
+	int seen;
+
+	tpool_self = w;
+	for (;;) {
+		if ((f = find_task(w)) != NULL) {
+			w->tasks++;
+			run_task(p, f);
+			continue;
+		}
+
+		seen = __atomic_load_n(&p->seq, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+		if ((f = find_task(w)) != NULL) {
+			__atomic_sub_fetch(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+			w->tasks++;
+			run_task(p, f);
+			continue;
+		}
+		/* Once stopping, leave as soon as there is nothing left to do */
+		if (__atomic_load_n(&p->stopping, __ATOMIC_SEQ_CST)) {
+			__atomic_sub_fetch(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+			break;
+		}
+		futex_wait(&p->seq, seen);
+		__atomic_sub_fetch(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+	}
+
+	return NULL;
+}
+
+/*********************************
+ *                               *
+ * Pool                          *
+ *                               *
+ *********************************/
+
+/* Start nworkers threads; queue_cap is the shared queue size, 0 for default */
+void tpool_init(struct tpool *p, int nworkers, int queue_cap)
+{
+	int i, ret;
+
+	memset(p, 0, sizeof(*p));
+	p->nworkers = nworkers;
+	queue_init(&p->queue, queue_cap > 0 ? queue_cap : TPOOL_QUEUE_CAP);
+
+	p->workers = sync_malloc_aligned(nworkers * sizeof(*p->workers));
+	memset(p->workers, 0, nworkers * sizeof(*p->workers));
+
+	for (i = 0; i < nworkers; i++) {
+		p->workers[i].pool = p;
+		p->workers[i].id = i;
+		p->workers[i].seed = i + 1;
+		deque_init(&p->workers[i].deque);
+	}
+	for (i = 0; i < nworkers; i++) {
+		ret = pthread_create(&p->workers[i].tid, NULL, worker_fn, &p->workers[i]);
+		if (ret) {
+			perror_pthread(ret, "pthread_create");
+			exit(1);
+		}
+	}
+}
+
+/*
+ * Run fn(arg) on the pool. If f is not NULL, it is the task's future,
+ * to be waited for with tpool_future_get(); otherwise, nobody waits
+ * for this task, except in tpool_wait_all().
+ * Called from outside the pool, this may wait for room in the queue;
+ * called from a task, with no room anywhere, it runs the new task
+ * right away. Return -1, with errno set, if the pool is shutting down.
+ */
+int tpool_submit(struct tpool *p, tpool_fn *fn, void *arg,
+	struct tpool_future *f)
+{
+	struct tpool_worker *w = tpool_self;
+
+	if (__atomic_load_n(&p->stopping, __ATOMIC_SEQ_CST)) {
+		errno = ESHUTDOWN;
+		return -1;
+	}
+
+	if (f == NULL) {
+		f = sync_malloc(sizeof(*f));
+		f->detached = 1;
+	} else
+		f->detached = 0;
+	f->fn = fn;
+	f->arg = arg;
+	f->result = NULL;
+	f->state = 0;
+	__atomic_add_fetch(&p->pending, 1, __ATOMIC_ACQ_REL);
+
+	if (w && w->pool == p) {
+		if (!deque_push(&w->deque, f) && !queue_trypush(&p->queue, f)) {
+			run_task(p, f);
+			return 0;
+		}
+	} else
+		queue_push(&p->queue, f);
+
+	wake_worker(p);
+	return 0;
+}
+
+/*
+ * Mark future f as waited for; return 0 if its task is done already.
+ * seq_cst, so that the task's completion sees a worker announced
+ * in sleepers before this.
+ */
+static int future_mark_waited(struct tpool_future *f)
+{
+	int s = 0;
+
+	if (__atomic_compare_exchange_n(&f->state, &s, 2, 0,
+	    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		return 1;
+	return s == 2;
+}
+
+/*
+ * Wait for the task of future f, and return its result.
+ * A task waiting for another one runs other tasks meanwhile, including
+ * any submitted while it waits, so that waiting tasks cannot keep every
+ * worker busy doing nothing.
+ */
+void *tpool_future_get(struct tpool *p, struct tpool_future *f)
+{
+	struct tpool_worker *w = tpool_self;
+	struct tpool_future *g;
+	int seen;
+
+	if (!w || w->pool != p) {
+		while (future_mark_waited(f))
+			futex_wait(&f->state, 2);
+		return f->result;
+	}
+
+	/* A worker sleeps like an idle one, but also leaves once f is done */
+	while (__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) != 1) {
+		if ((g = find_task(w)) != NULL) {
+			w->tasks++;
+			run_task(p, g);
+			continue;
+		}
+
+		seen = __atomic_load_n(&p->seq, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+		if ((g = find_task(w)) != NULL) {
+			__atomic_sub_fetch(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+			w->tasks++;
+			run_task(p, g);
+			continue;
+		}
+		if (future_mark_waited(f))
+			futex_wait(&p->seq, seen);
+		__atomic_sub_fetch(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+	}
+
+	return f->result;
+}
+
+/* Wait until every task submitted so far has run; not from a task */
+void tpool_wait_all(struct tpool *p)
+{
+	int n;
+
+	while ((n = __atomic_load_n(&p->pending, __ATOMIC_ACQUIRE)) != 0)
+		futex_wait(&p->pending, n);
+}
+
+/*
+ * Shut the pool down gracefully: no new tasks are accepted,
+ * but all those already submitted are run, then the workers exit.
+ */
+void tpool_shutdown(struct tpool *p)
+{
+	int i, ret;
+
+	__atomic_store_n(&p->stopping, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&p->seq, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&p->seq, INT_MAX);
+
+	for (i = 0; i < p->nworkers; i++) {
+		ret = pthread_join(p->workers[i].tid, NULL);
+		if (ret)
+			perror_pthread(ret, "pthread_join");
+	}
+
+	free(p->workers);
+	queue_destroy(&p->queue);
+}
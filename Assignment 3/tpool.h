@@ -0,0 +1,83 @@
+/*
+ * tpool.h
+ *
+ * A pool of worker threads, created once and reused, that run tasks.
+ *
+ * Tasks submitted from outside the pool go into a bounded queue shared
+ * by all workers; tasks submitted by a task go into its worker's own
+ * deque. Idle workers look in their own deque first, then in the
+ * shared queue, then steal from the other workers' deques.
+ *
+ */
+
+#ifndef TPOOL_H__
+#define TPOOL_H__
+
+#include <pthread.h>
+
+#include "sync-lib.h"
+
+#define TPOOL_QUEUE_CAP 1024    /* Default size of the shared queue */
+#define TPOOL_DEQUE_CAP 256     /* Size of every worker's deque */
+
+typedef void *tpool_fn(void *arg);
+
+/*
+ * A task, and the future of its result. Submitting with a future lets
+ * the caller wait for the result; it must stay around until then.
+ */
+struct tpool_future {
+	tpool_fn *fn;
+	void *arg;
+	void *result;
+	int state;              /* 0 pending, 2 waited for, 1 done */
+	int detached;           /* Allocated by the pool, freed when done */
+};
+
+/* A bounded queue, many producers, many consumers */
+struct tpool_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_full;
+	struct tpool_future **slots;
+	int cap, head, count;
+};
+
+/* A worker's deque: the owner works at the bottom, thieves at the top */
+struct tpool_deque {
+	struct futex_mutex lock;
+	struct tpool_future *slots[TPOOL_DEQUE_CAP];
+	long top, bottom;
+};
+
+struct tpool;
+
+struct tpool_worker {
+	pthread_t tid;
+	struct tpool *pool;
+	int id;
+	unsigned int seed;      /* For picking victims to steal from */
+	long tasks;             /* Tasks run */
+	long steals;            /* Of which, stolen from other workers */
+	struct tpool_deque deque;
+} __attribute__((aligned(SYNC_CACHE_LINE)));
+
+struct tpool {
+	int nworkers;
+	struct tpool_worker *workers;
+	struct tpool_queue queue;
+
+	int seq __attribute__((aligned(SYNC_CACHE_LINE)));
+	int sleepers;           /* Workers asleep, or about to, on seq */
+	int pending __attribute__((aligned(SYNC_CACHE_LINE)));
+	int stopping;
+};
+
+/* Function prototypes */
+void tpool_init(struct tpool *p, int nworkers, int queue_cap);
+void tpool_shutdown(struct tpool *p);
+int tpool_submit(struct tpool *p, tpool_fn *fn, void *arg,
+	struct tpool_future *f);
+void *tpool_future_get(struct tpool *p, struct tpool_future *f);
+void tpool_wait_all(struct tpool *p);
+
+#endif /* TPOOL_H__ */